@@ -2,5 +2,17 @@
 set -e
 mkdir -p $(pwd)/build
 
-g++ -D DEBUG -lX11 scame.cpp -o $(pwd)/build/scame \
-    -Wall -Wextra -pedantic -std=c++20
+# SCAME_XCB=1 sh build.sh sends the startup requests over XCB, all at once
+# instead of a round trip each, which is what startup costs over remote X
+libraries="-lX11 -lXext"
+defines=""
+if [ -n "$SCAME_XCB" ]; then
+    libraries="$libraries -lX11-xcb -lxcb"
+    defines="-D SCAME_XCB"
+fi
+
+# Libraries go after the source file, otherwise linkers that default to
+# --as-needed drop them before seeing any references
+g++ -D DEBUG $defines scame.cpp -o $(pwd)/build/scame \
+    -Wall -Wextra -pedantic -std=c++20 \
+    -pthread $libraries
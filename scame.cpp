@@ -1,16 +1,43 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <signal.h>
 #include <math.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <linux/io_uring.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
+#include <X11/extensions/sync.h>
+// Present's client libraries (libXpresent, xcb-present) aren't something we
+// can count on being installed, the few requests we need are put together
+// by hand, see Presenter
+#include <X11/Xlibint.h>
+#include <X11/extensions/presentproto.h>
+// Xlibint.h's, they get in the way of std::min and std::max
+#undef min
+#undef max
+#if defined(SCAME_XCB)
+// Startup requests go out over the XCB connection underneath Xlib's, see
+// X_Setup
+#include <X11/Xlib-xcb.h>
+#endif
 
 #define ARRAY_COUNT(static_array) ( sizeof(static_array) / sizeof(*(static_array)) )
 
@@ -34,248 +61,6248 @@
             exit(1);                            \
         }                                       \
     }
-#endif
+#endif
+
+void stbtt_assert_wrapper(int expression) {
+    assert(expression);
+}
+
+#define STB_TRUETYPE_IMPLEMENTATION
+#define STBTT_assert(expression) stbtt_assert_wrapper(expression)
+#include "stb_truetype.h"
+
+typedef char* cstring;
+typedef uint8_t u8;
+typedef int32_t s32;
+typedef float f32;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef uint64_t usize;
+
+// Probably doesn't make sense to have all of this as global;
+Display* display;
+int root_window;
+int default_screen;
+XVisualInfo visinfo;
+Window window;
+
+struct u8_array {
+    u8* base;
+    usize count;
+};
+
+typedef u8_array String;
+
+// Maybe it's better to use strlen instead, won't have to subtract 1 then
+#define S(static_string) String { (u8*)static_string, ARRAY_COUNT(static_string) - 1 }
+
+// Apparently, using anonymous strutcs inside unions like in C is considered UB
+// in C++, but it's very convenient and all compilers do the right thing,
+// so I don't give a fuck about this particular part of the C++ spec
+#pragma GCC diagnostic ignored "-Wpedantic"
+// NOTE: red and blue are inverted it seems, so an actual layout is bgra
+union rgba8 {
+    struct {
+        u8 red, green, blue, alpha;
+    };
+
+    struct {
+        u8 r, g, b, a;
+    };
+
+    u32 value32;
+    u8 values8[4];
+};
+#pragma GCC diagnostic pop
+
+// Either owns its pixels or is a view into another one's. Pixel (x, y),
+// with (0,0) in the bottom-left corner, is origin[y * stride + x]. Owned
+// ones are laid out top-down like XImage wants them, so going up a row is
+// going back in memory and stride is negative.
+struct SR_Frame_Buffer {
+    s32 width, height;
+    rgba8* origin;
+    s32 stride;
+    // What was allocated, views have neither
+    rgba8 *base;
+    // Pixels there's memory for, resizing within that doesn't reallocate
+    usize capacity;
+};
+
+#define PLATFORM_PAGE_SIZE 4096
+#define PLATFORM_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Address space only, pages get committed when touched. Unlike malloc'ed
+// memory it never moves, so whatever points into it stays valid.
+u8* platform_reserve_bytes(usize byte_count) {
+    auto base = (u8*)mmap(0, byte_count, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(base != MAP_FAILED, "ERROR: couldn't reserve address space");
+    return base;
+}
+
+// Memory accounting
+//
+// Every arena and framebuffer is tagged with what it's for, and committed
+// bytes are counted per tag, live and peak. Arenas don't give pages back
+// until they're freed, so that's close to what each part adds to RSS. Files
+// read into memory count as text, mapped ones are page cache and don't.
+// Allocations are also counted per call site (function and line), which
+// tells which push inside a tag is the hungry one. F1 toggles an overlay
+// with the tags, F2 prints the full report.
+enum Memory_Tag {
+    MEMORY_PERMANENT,
+    MEMORY_TEXT,
+    MEMORY_ADDED_TEXT,
+    MEMORY_PIECES,
+    MEMORY_UNDO,
+    MEMORY_LINE_INDEX,
+    MEMORY_FRAME_BUFFER,
+    MEMORY_FONT,
+    MEMORY_LOADER,
+    MEMORY_SAVE,
+    MEMORY_SCRATCH,
+    MEMORY_FRAME,
+    MEMORY_TAG_COUNT,
+};
+
+cstring memory_tag_names[MEMORY_TAG_COUNT] = {
+    (cstring)"permanent", (cstring)"text", (cstring)"added text", (cstring)"pieces",
+    (cstring)"undo", (cstring)"line index", (cstring)"framebuffer", (cstring)"font",
+    (cstring)"loader", (cstring)"save", (cstring)"scratch", (cstring)"frame",
+};
+
+struct Memory_Stats {
+    // Accessed atomically
+    u64 live;
+    u64 peak;
+};
+
+Memory_Stats memory_stats[MEMORY_TAG_COUNT];
+
+void memory_commit(Memory_Tag tag, usize byte_count) {
+    Memory_Stats* stats = &memory_stats[tag];
+    u64 live = __atomic_add_fetch(&stats->live, byte_count, __ATOMIC_RELAXED);
+    u64 peak = __atomic_load_n(&stats->peak, __ATOMIC_RELAXED);
+    while(live > peak &&
+          !__atomic_compare_exchange_n(&stats->peak, &peak, live, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+void memory_decommit(Memory_Tag tag, usize byte_count) {
+    __atomic_sub_fetch(&memory_stats[tag].live, byte_count, __ATOMIC_RELAXED);
+}
+
+#define ALLOCATION_SITE_COUNT 256
+
+struct Allocation_Site {
+    // Accessed atomically, 0 while the slot is free. function and line are
+    // filled in by whoever claims it.
+    u64 key;
+    cstring function;
+    u32 line;
+    Memory_Tag tag;
+    // Accessed atomically
+    u64 count;
+    u64 byte_count;
+};
+
+// Open addressing, sites are never removed. When it's full, new sites just
+// don't get counted.
+Allocation_Site allocation_sites[ALLOCATION_SITE_COUNT];
+
+// Debug builds only, it's an atomic or two on every allocation
+void memory_count_site(cstring function, u32 line, Memory_Tag tag, usize byte_count) {
+#if defined DEBUG
+    // The same line can allocate with different tags, e.g. make_frame_buffer
+    u64 key = ((u64)function * 0x9E3779B97F4A7C15ull) ^ ((u64)line << 8) ^ tag;
+    key |= 1;
+    usize slot = (key >> 32) & (ALLOCATION_SITE_COUNT - 1);
+    for(usize probe = 0; probe < ALLOCATION_SITE_COUNT; probe++) {
+        Allocation_Site* site = &allocation_sites[slot];
+        u64 expected = 0;
+        int found = __atomic_load_n(&site->key, __ATOMIC_ACQUIRE) == key;
+        if(!found && __atomic_compare_exchange_n(&site->key, &expected, key, 0,
+                                                 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            site->function = function;
+            site->line = line;
+            site->tag = tag;
+            found = 1;
+        }
+        if(found) {
+            __atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&site->byte_count, byte_count, __ATOMIC_RELAXED);
+            return;
+        }
+        slot = (slot + 1) & (ALLOCATION_SITE_COUNT - 1);
+    }
+#else
+    (void)function;
+    (void)line;
+    (void)tag;
+    (void)byte_count;
+#endif
+}
+
+void print_memory_report() {
+    printf("memory              live KB    peak KB\n");
+    u64 total_live = 0;
+    u64 total_peak = 0;
+    for(int i = 0; i < MEMORY_TAG_COUNT; i++) {
+        u64 live = __atomic_load_n(&memory_stats[i].live, __ATOMIC_RELAXED);
+        u64 peak = __atomic_load_n(&memory_stats[i].peak, __ATOMIC_RELAXED);
+        total_live += live;
+        total_peak += peak;
+        if(!peak) continue;
+        printf("%-15s %11lu %10lu\n", memory_tag_names[i], live / 1024, peak / 1024);
+    }
+    // Peaks of different tags don't have to happen at the same time
+    printf("%-15s %11lu %10lu\n", "total", total_live / 1024, total_peak / 1024);
+
+#if defined DEBUG
+    printf("\nallocation site                      tag          count   total KB\n");
+    for(int i = 0; i < ALLOCATION_SITE_COUNT; i++) {
+        Allocation_Site* site = &allocation_sites[i];
+        if(!__atomic_load_n(&site->key, __ATOMIC_ACQUIRE) || !site->function) continue;
+        printf("%-30s %5u %-11s %6lu %10lu\n", site->function, site->line,
+               memory_tag_names[site->tag], __atomic_load_n(&site->count, __ATOMIC_RELAXED),
+               __atomic_load_n(&site->byte_count, __ATOMIC_RELAXED) / 1024);
+    }
+#endif
+}
+
+// Arenas
+//
+// An arena reserves a big range of address space up front and commits it
+// as it fills up, so allocating is bumping a pointer and nothing in it ever
+// moves. There's no freeing single allocations: the whole arena gets reset,
+// or a temp marker gives back everything pushed after it. An arena belongs
+// to one thread at a time, so there's nothing to lock either.
+#define ARENA_COMMIT_SIZE (64 * 1024)
+#define ARENA_DEFAULT_RESERVE (4ull * 1024 * 1024 * 1024)
+
+struct Arena {
+    u8* base;
+    usize reserved;
+    usize committed;
+    usize used;
+    Memory_Tag tag;
+};
+
+struct Arena_Marker {
+    Arena* arena;
+    usize used;
+};
+
+Arena make_arena(usize reserve_size, Memory_Tag tag) {
+    Arena arena = {};
+    arena.tag = tag;
+    arena.reserved = (reserve_size + PLATFORM_PAGE_SIZE - 1) & ~(usize)(PLATFORM_PAGE_SIZE - 1);
+    arena.reserved = std::max(arena.reserved, (usize)PLATFORM_PAGE_SIZE);
+    // PROT_NONE until committed, so running past what we asked for faults
+    // instead of quietly eating memory
+    arena.base = (u8*)mmap(0, arena.reserved, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(arena.base != MAP_FAILED, "ERROR: couldn't reserve address space");
+    return arena;
+}
+
+void free_arena(Arena* arena) {
+    if(arena->base) munmap(arena->base, arena->reserved);
+    memory_decommit(arena->tag, arena->committed);
+    *arena = {};
+}
+
+// Not zeroed, memory given back by a temp marker keeps its old contents.
+// The caller's function and line are there for the allocation site counts.
+u8* arena_push(Arena* arena, usize byte_count, usize alignment,
+               cstring function = (cstring)__builtin_FUNCTION(), u32 line = __builtin_LINE()) {
+    usize start = (arena->used + alignment - 1) & ~(alignment - 1);
+    usize end = start + byte_count;
+    assert(end <= arena->reserved, "ERROR: arena ran out of address space");
+    if(end > arena->committed) {
+        usize commit_end = (end + ARENA_COMMIT_SIZE - 1) & ~(usize)(ARENA_COMMIT_SIZE - 1);
+        commit_end = std::min(commit_end, arena->reserved);
+        int err = mprotect(arena->base + arena->committed, commit_end - arena->committed,
+                           PROT_READ | PROT_WRITE);
+        assert(!err, "ERROR: out of memory");
+        memory_commit(arena->tag, commit_end - arena->committed);
+        arena->committed = commit_end;
+    }
+    memory_count_site(function, line, arena->tag, byte_count);
+    arena->used = end;
+    return arena->base + start;
+}
+
+#define arena_push_struct(arena, Type) ((Type*)arena_push((arena), sizeof(Type), alignof(Type)))
+#define arena_push_array(arena, Type, count) \
+    ((Type*)arena_push((arena), sizeof(Type) * (count), alignof(Type)))
+
+// For an arena that holds a single growing array: makes sure it has room
+// for byte_count bytes from the base. Growing never copies, unlike realloc.
+u8* arena_grow_to(Arena* arena, usize byte_count,
+                  cstring function = (cstring)__builtin_FUNCTION(), u32 line = __builtin_LINE()) {
+    if(byte_count > arena->used) arena_push(arena, byte_count - arena->used, 1, function, line);
+    return arena->base;
+}
+
+Arena_Marker arena_begin_temp(Arena* arena) {
+    return Arena_Marker {arena, arena->used};
+}
+
+void arena_end_temp(Arena_Marker marker) {
+    marker.arena->used = marker.used;
+}
+
+void arena_reset(Arena* arena) {
+    arena->used = 0;
+}
+
+// Things that live until exit. Subsystems with shorter lived memory have
+// arenas of their own, this one is shared by all threads.
+Arena permanent_arena;
+pthread_mutex_t permanent_arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+u8* platform_allocate_bytes(usize byte_count,
+                           cstring function = (cstring)__builtin_FUNCTION(),
+                           u32 line = __builtin_LINE()) {
+    pthread_mutex_lock(&permanent_arena_mutex);
+    if(!permanent_arena.base) {
+        permanent_arena = make_arena(ARENA_DEFAULT_RESERVE, MEMORY_PERMANENT);
+    }
+    u8* base = arena_push(&permanent_arena, byte_count, 16, function, line);
+    pthread_mutex_unlock(&permanent_arena_mutex);
+    return base;
+}
+
+// Events are eventfds, one thread signals and another one waits
+void platform_signal_event(int fd) {
+    if(fd < 0) return;
+    u64 one = 1;
+    ssize_t written = write(fd, &one, sizeof(one));
+    (void)written;
+}
+
+// Doesn't block, returns how many times it was signaled since last time
+u64 platform_consume_events(int fd) {
+    u64 count = 0;
+    ssize_t read_count = read(fd, &count, sizeof(count));
+    return read_count == sizeof(count) ? count : 0;
+}
+
+void platform_wait_event(int fd, int timeout_ms = -1) {
+    pollfd poll_fd = {fd, POLLIN, 0};
+    while(poll(&poll_fd, 1, timeout_ms) < 0 && errno == EINTR) {}
+    platform_consume_events(fd);
+}
+
+enum Access_Pattern {
+    ACCESS_NORMAL,
+    // Aggressive readahead, pages behind get dropped first
+    ACCESS_SEQUENTIAL,
+    // No readahead at all
+    ACCESS_RANDOM,
+    // Start reading it in now, without waiting for the fault
+    ACCESS_WILL_NEED,
+};
+
+u64 platform_get_time_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (u64)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// Only a hint, so failures don't matter
+void platform_advise(void* base, usize count, Access_Pattern pattern) {
+    if(!count) return;
+    // madvise wants a page aligned start
+    usize start = (usize)base & ~(usize)(PLATFORM_PAGE_SIZE - 1);
+    usize end = (usize)base + count;
+    int advice = MADV_NORMAL;
+    if(pattern == ACCESS_SEQUENTIAL) advice = MADV_SEQUENTIAL;
+    if(pattern == ACCESS_RANDOM) advice = MADV_RANDOM;
+    if(pattern == ACCESS_WILL_NEED) advice = MADV_WILLNEED;
+    madvise((void*)start, end - start, advice);
+}
+
+// Memory that's written from start to end all the time, like framebuffers.
+// Big allocations are aligned to 2MB so transparent huge pages can back
+// them, a 4K framebuffer is 8000 TLB entries with regular pages and 16
+// with huge ones.
+u8* platform_allocate_huge_bytes(usize byte_count, Memory_Tag tag,
+                                 cstring function = (cstring)__builtin_FUNCTION(),
+                                 u32 line = __builtin_LINE()) {
+    byte_count = (byte_count + PLATFORM_PAGE_SIZE - 1) & ~(usize)(PLATFORM_PAGE_SIZE - 1);
+    if(!byte_count) byte_count = PLATFORM_PAGE_SIZE;
+    memory_commit(tag, byte_count);
+    memory_count_site(function, line, tag, byte_count);
+    if(byte_count < PLATFORM_HUGE_PAGE_SIZE) {
+        auto base = (u8*)mmap(0, byte_count, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(base != MAP_FAILED, "ERROR: out of memory");
+        return base;
+    }
+
+    // Over-allocate and trim both ends to get the alignment
+    usize mapped_count = byte_count + PLATFORM_HUGE_PAGE_SIZE;
+    auto mapped = (u8*)mmap(0, mapped_count, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(mapped != MAP_FAILED, "ERROR: out of memory");
+    usize start = ((usize)mapped + PLATFORM_HUGE_PAGE_SIZE - 1) & ~(usize)(PLATFORM_HUGE_PAGE_SIZE - 1);
+    auto base = (u8*)start;
+    if(base > mapped) munmap(mapped, base - mapped);
+    u8* end = base + byte_count;
+    if(mapped + mapped_count > end) munmap(end, mapped + mapped_count - end);
+
+    madvise(base, byte_count, MADV_HUGEPAGE);
+    return base;
+}
+
+void platform_free_huge_bytes(void* base, usize byte_count, Memory_Tag tag) {
+    byte_count = (byte_count + PLATFORM_PAGE_SIZE - 1) & ~(usize)(PLATFORM_PAGE_SIZE - 1);
+    if(!byte_count) byte_count = PLATFORM_PAGE_SIZE;
+    memory_decommit(tag, byte_count);
+    munmap(base, byte_count);
+}
+
+// Page faults per kind of work. Counted with getrusage per thread, so
+// operations on the loader and indexing threads don't pollute the UI ones.
+enum Fault_Operation {
+    FAULT_LOAD,
+    FAULT_INDEX,
+    FAULT_SCROLL,
+    FAULT_JUMP,
+    FAULT_DRAW,
+    FAULT_SAVE,
+    FAULT_OPERATION_COUNT,
+};
+
+struct Fault_Stats {
+    // Accessed atomically
+    u64 count;
+    u64 minor_faults;
+    u64 major_faults;
+};
+
+Fault_Stats fault_stats[FAULT_OPERATION_COUNT];
+
+struct Fault_Scope {
+    Fault_Operation operation;
+    long minor_faults;
+    long major_faults;
+};
+
+Fault_Scope begin_fault_scope(Fault_Operation operation) {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return Fault_Scope {operation, usage.ru_minflt, usage.ru_majflt};
+}
+
+void end_fault_scope(Fault_Scope scope) {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    Fault_Stats* stats = &fault_stats[scope.operation];
+    __atomic_fetch_add(&stats->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->minor_faults, usage.ru_minflt - scope.minor_faults, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->major_faults, usage.ru_majflt - scope.major_faults, __ATOMIC_RELAXED);
+}
+
+void print_fault_stats() {
+    cstring names[FAULT_OPERATION_COUNT] = {
+        (cstring)"load", (cstring)"index", (cstring)"scroll",
+        (cstring)"jump", (cstring)"draw", (cstring)"save",
+    };
+    printf("page faults      count      minor      major  minor/op\n");
+    for(int i = 0; i < FAULT_OPERATION_COUNT; i++) {
+        Fault_Stats* stats = &fault_stats[i];
+        u64 count = __atomic_load_n(&stats->count, __ATOMIC_RELAXED);
+        if(!count) continue;
+        u64 minor = __atomic_load_n(&stats->minor_faults, __ATOMIC_RELAXED);
+        u64 major = __atomic_load_n(&stats->major_faults, __ATOMIC_RELAXED);
+        printf("%-10s %11lu %10lu %10lu %9.1f\n", names[i], count, minor, major,
+               (double)minor / count);
+    }
+}
+
+#if defined DEBUG
+// Counts heap allocations made by each thread, whoever makes them, Xlib and
+// libc included. Frames are supposed to get their memory from the frame
+// arena, this is how we notice when something sneaks a malloc in.
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* base, size_t size);
+
+thread_local u64 heap_allocation_count;
+
+extern "C" void* malloc(size_t size) {
+    heap_allocation_count++;
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+    heap_allocation_count++;
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* base, size_t size) {
+    heap_allocation_count++;
+    return __libc_realloc(base, size);
+}
+#endif
+
+u64 frame_heap_allocation_start() {
+#if defined DEBUG
+    return heap_allocation_count;
+#else
+    return 0;
+#endif
+}
+
+#define FRAME_WARM_UP_COUNT 8
+
+// Steady frames are the ones that only scroll and draw, those have to get
+// by with the frame arena
+void check_frame_heap_allocations(u64 start, int steady_frame) {
+#if defined DEBUG
+    u64 count = heap_allocation_count - start;
+    assert(!steady_frame || !count, "ERROR: %lu heap allocations in a steady frame", count);
+#else
+    (void)start;
+    (void)steady_frame;
+#endif
+}
+
+SR_Frame_Buffer make_frame_buffer(s32 width, s32 height,
+                                  Memory_Tag tag = MEMORY_FRAME_BUFFER, usize capacity = 0,
+                                  cstring function = (cstring)__builtin_FUNCTION(),
+                                  u32 line = __builtin_LINE()) {
+    SR_Frame_Buffer frame_buffer = {};
+    frame_buffer.width = width;
+    frame_buffer.height = height;
+    frame_buffer.capacity = std::max(capacity, (usize)width * height);
+    frame_buffer.base = (rgba8*)platform_allocate_huge_bytes(
+        frame_buffer.capacity * sizeof(rgba8), tag, function, line);
+    frame_buffer.stride = -width;
+    frame_buffer.origin = frame_buffer.base + (usize)std::max(height - 1, 0) * width;
+
+    return frame_buffer;
+}
+
+// The width x height rectangle at x, y of parent, as far as it's inside of
+// it. Draws straight into the parent's pixels, nothing gets copied.
+SR_Frame_Buffer frame_buffer_view(SR_Frame_Buffer* parent, s32 x, s32 y, s32 width, s32 height) {
+    s32 end_x = std::min(x + width, parent->width);
+    s32 end_y = std::min(y + height, parent->height);
+    x = std::max(x, 0);
+    y = std::max(y, 0);
+
+    SR_Frame_Buffer view = {};
+    view.width = std::max(end_x - x, 0);
+    view.height = std::max(end_y - y, 0);
+    view.stride = parent->stride;
+    view.origin = parent->origin + y * parent->stride + x;
+    return view;
+}
+
+inline rgba8* sr_row(SR_Frame_Buffer* frame_buffer, s32 y) {
+    return frame_buffer->origin + y * frame_buffer->stride;
+}
+
+inline rgba8* sr_pixel(SR_Frame_Buffer* frame_buffer, s32 x, s32 y) {
+    return sr_row(frame_buffer, y) + x;
+}
+
+void free_frame_buffer(SR_Frame_Buffer* frame_buffer, Memory_Tag tag = MEMORY_FRAME_BUFFER) {
+    assert(frame_buffer->base, "Views don't own their pixels");
+    platform_free_huge_bytes(frame_buffer->base, frame_buffer->capacity * sizeof(rgba8), tag);
+    *frame_buffer = {};
+}
+
+// Within the capacity only the dimensions change, the contents get redrawn
+// anyway. Growing past it reallocates with headroom, so dragging a window
+// edge outwards doesn't allocate on every step. Pages past what's drawn
+// are never touched, so a big capacity costs address space, not memory.
+void resize_frame_buffer(SR_Frame_Buffer* frame_buffer, s32 width, s32 height,
+                         Memory_Tag tag = MEMORY_FRAME_BUFFER) {
+    usize pixel_count = (usize)width * height;
+    if(pixel_count > frame_buffer->capacity) {
+        usize capacity = std::max(pixel_count, frame_buffer->capacity + frame_buffer->capacity / 2);
+        free_frame_buffer(frame_buffer, tag);
+        *frame_buffer = make_frame_buffer(width, height, tag, capacity);
+    }
+    frame_buffer->width = width;
+    frame_buffer->height = height;
+    frame_buffer->stride = -width;
+    frame_buffer->origin = frame_buffer->base + (usize)std::max(height - 1, 0) * width;
+}
+
+struct SR_Rect {
+    // Bottom-left corner, like everything else
+    s32 x, y, width, height;
+};
+
+SR_Rect sr_intersect(SR_Rect a, SR_Rect b) {
+    s32 x = std::max(a.x, b.x);
+    s32 y = std::max(a.y, b.y);
+    s32 end_x = std::min(a.x + a.width, b.x + b.width);
+    s32 end_y = std::min(a.y + a.height, b.y + b.height);
+    return SR_Rect {x, y, std::max(end_x - x, 0), std::max(end_y - y, 0)};
+}
+
+// The primitives only touch pixels inside clip, which is how the tiled
+// renderer keeps each worker inside its tile
+void fill_box_clipped(SR_Frame_Buffer* frame_buffer, SR_Rect clip,
+                      s32 x, s32 y, s32 width, s32 height, rgba8 color) {
+    clip = sr_intersect(clip, SR_Rect {0, 0, frame_buffer->width, frame_buffer->height});
+    SR_Rect box = sr_intersect(SR_Rect {x, y, width, height}, clip);
+
+    for(s32 y_it = box.y; y_it < box.y + box.height; y_it++) {
+        rgba8* row = sr_row(frame_buffer, y_it);
+        for(s32 x_it = box.x; x_it < box.x + box.width; x_it++) {
+            row[x_it] = color;
+        }
+    }
+}
+
+void fill_box(SR_Frame_Buffer* frame_buffer,
+              s32 x, s32 y, s32 width, s32 height, rgba8 color) {
+    fill_box_clipped(frame_buffer, SR_Rect {0, 0, frame_buffer->width, frame_buffer->height},
+                     x, y, width, height, color);
+}
+
+// Copies the width x height rectangle at src_x, src_y so that it lands at
+// dest_x, dest_y, as far as it's inside clip
+void blit_clipped(SR_Frame_Buffer* dest, SR_Rect clip, s32 dest_x, s32 dest_y,
+                  SR_Frame_Buffer* src, s32 src_x, s32 src_y, s32 width, s32 height) {
+    clip = sr_intersect(clip, SR_Rect {0, 0, dest->width, dest->height});
+    SR_Rect box = sr_intersect(SR_Rect {dest_x, dest_y, width, height}, clip);
+
+    for(s32 y = box.y; y < box.y + box.height; y++) {
+        rgba8* src_row = sr_row(src, y - dest_y + src_y) + src_x - dest_x;
+        rgba8* dest_row = sr_row(dest, y);
+        for(s32 x = box.x; x < box.x + box.width; x++) {
+            dest_row[x] = src_row[x];
+        }
+    }
+}
+
+void blit(SR_Frame_Buffer* dest, s32 dest_x, s32 dest_y,
+          SR_Frame_Buffer* src, s32 src_x, s32 src_y, s32 src_width, s32 src_height) {
+    assert(dest->origin != src->origin);
+    assert((0 <= src_x) && (src_x < src->width));
+    assert((0 <= src_y) && (src_y < src->height));
+    assert(src_width >= 0);
+    assert(src_x + src_width <= src->width);
+    assert(src_height >=0);
+    assert(src_y + src_height <= src->height);
+
+    blit_clipped(dest, SR_Rect {0, 0, dest->width, dest->height}, dest_x, dest_y,
+                 src, src_x, src_y, src_width, src_height);
+}
+
+struct Glyph {
+    // Rectangle inside of the font atlas
+    s32 x, y, width, height;
+    // Offset of the bitmap's bottom-left corner relative to the pen position
+    // on the baseline
+    s32 x_offset, y_offset;
+    s32 advance;
+};
+
+struct SR_Font {
+    SR_Frame_Buffer atlas;
+    // Only ASCII for now
+    Glyph glyphs[128];
+    s32 ascent, descent, line_spacing;
+    // Hack is monospace, so it's just an advance of any glyph
+    s32 advance;
+};
+
+// Like blit, but uses atlas alpha as a coverage to blend the color in
+void blit_glyph_clipped(SR_Frame_Buffer* dest, SR_Rect clip, s32 dest_x, s32 dest_y,
+                        SR_Frame_Buffer* atlas, s32 src_x, s32 src_y, s32 width, s32 height,
+                        rgba8 color) {
+    clip = sr_intersect(clip, SR_Rect {0, 0, dest->width, dest->height});
+    SR_Rect box = sr_intersect(SR_Rect {dest_x, dest_y, width, height}, clip);
+
+    for(s32 y = box.y; y < box.y + box.height; y++) {
+        rgba8* src_row = sr_row(atlas, y - dest_y + src_y) + src_x - dest_x;
+        rgba8* dest_row = sr_row(dest, y);
+        for(s32 x = box.x; x < box.x + box.width; x++) {
+            u32 coverage = src_row[x].a;
+            if(!coverage) continue;
+
+            auto pixel = &dest_row[x];
+            pixel->r = (color.r * coverage + pixel->r * (255 - coverage)) / 255;
+            pixel->g = (color.g * coverage + pixel->g * (255 - coverage)) / 255;
+            pixel->b = (color.b * coverage + pixel->b * (255 - coverage)) / 255;
+        }
+    }
+}
+
+// Command lists
+//
+// Drawing code doesn't touch pixels, it records commands, and the renderer
+// executes them later. Before that it gets a pass over the whole list that
+// resolves clips and merges what can be drawn as one command, see
+// optimize_command_list, and then the frame is cut into tiles and
+// rasterized in parallel, see the tiled renderer below.
+enum SR_Command_Kind {
+    SR_COMMAND_FILL,
+    SR_COMMAND_BLIT,
+    // Glyphs from one atlas in one color, blended in with the atlas alpha
+    // as coverage
+    SR_COMMAND_GLYPH_RUN,
+    // Everything until the matching pop only draws inside the clip
+    SR_COMMAND_PUSH_CLIP,
+    SR_COMMAND_POP_CLIP,
+};
+
+#define SR_MAX_CLIP_DEPTH 16
+// Merged runs stay below this, every tile a run touches walks all of its
+// glyphs
+#define SR_MAX_RUN_GLYPHS 256
+// How far back a command may move to join a compatible one
+#define SR_MERGE_WINDOW 16
+
+struct SR_Glyph_Placement {
+    // Where the bottom-left corner lands and which atlas rectangle goes there
+    s32 x, y;
+    s32 source_x, source_y, width, height;
+};
+
+struct SR_Command {
+    SR_Command_Kind kind;
+    // Where it draws, that's also what it gets binned by. The clip for
+    // clip pushes.
+    SR_Rect bounds;
+    // Filled in by optimize_command_list from the clip stack
+    SR_Rect clip;
+    rgba8 color;
+    // Blits copy the bounds sized rectangle at source_x, source_y, glyph
+    // runs take their glyphs from it
+    SR_Frame_Buffer* source;
+    s32 source_x, source_y;
+    SR_Glyph_Placement* glyphs;
+    u32 glyph_count;
+};
+
+struct SR_Command_List {
+    // Size of what it's going to be drawn into
+    s32 width, height;
+    // Holds nothing but the commands, so they stay one array
+    Arena* arena;
+    SR_Command* commands;
+    usize count;
+    // Glyph placements of the runs, consecutive runs end up next to each
+    // other, which makes merging them free
+    Arena* glyph_arena;
+};
+
+SR_Command_List make_command_list(Arena* arena, Arena* glyph_arena, s32 width, s32 height) {
+    arena_reset(arena);
+    arena_reset(glyph_arena);
+    SR_Command_List list = {};
+    list.width = width;
+    list.height = height;
+    list.arena = arena;
+    list.commands = (SR_Command*)arena->base;
+    list.glyph_arena = glyph_arena;
+    return list;
+}
+
+SR_Command* push_command(SR_Command_List* list, SR_Command_Kind kind, SR_Rect bounds) {
+    arena_grow_to(list->arena, (list->count + 1) * sizeof(SR_Command));
+    SR_Command* command = &list->commands[list->count++];
+    *command = {};
+    command->kind = kind;
+    command->bounds = bounds;
+    return command;
+}
+
+void push_clip(SR_Command_List* list, s32 x, s32 y, s32 width, s32 height) {
+    push_command(list, SR_COMMAND_PUSH_CLIP, SR_Rect {x, y, width, height});
+}
+
+void pop_clip(SR_Command_List* list) {
+    push_command(list, SR_COMMAND_POP_CLIP, SR_Rect {});
+}
+
+void fill_box(SR_Command_List* list, s32 x, s32 y, s32 width, s32 height, rgba8 color) {
+    if(width <= 0 || height <= 0) return;
+    push_command(list, SR_COMMAND_FILL, SR_Rect {x, y, width, height})->color = color;
+}
+
+void blit(SR_Command_List* list, s32 dest_x, s32 dest_y,
+          SR_Frame_Buffer* src, s32 src_x, s32 src_y, s32 src_width, s32 src_height) {
+    assert((0 <= src_x) && (src_x < src->width));
+    assert((0 <= src_y) && (src_y < src->height));
+    assert(src_width >= 0);
+    assert(src_x + src_width <= src->width);
+    assert(src_height >=0);
+    assert(src_y + src_height <= src->height);
+
+    auto command = push_command(list, SR_COMMAND_BLIT,
+                                SR_Rect {dest_x, dest_y, src_width, src_height});
+    command->source = src;
+    command->source_x = src_x;
+    command->source_y = src_y;
+}
+
+SR_Rect sr_union(SR_Rect a, SR_Rect b) {
+    if(!a.width || !a.height) return b;
+    if(!b.width || !b.height) return a;
+    s32 x = std::min(a.x, b.x);
+    s32 y = std::min(a.y, b.y);
+    s32 end_x = std::max(a.x + a.width, b.x + b.width);
+    s32 end_y = std::max(a.y + a.height, b.y + b.height);
+    return SR_Rect {x, y, end_x - x, end_y - y};
+}
+
+// Records the whole string as one glyph run. Returns x position after the
+// last drawn character.
+s32 draw_text(SR_Command_List* list, SR_Font* font, s32 x, s32 baseline,
+              String text, rgba8 color) {
+    SR_Command* run = 0;
+    s32 start_x = x;
+    for(usize i = 0; i < text.count; i++) {
+        u8 c = text.base[i];
+        if(c == '\t') {
+            s32 column = (x - start_x) / font->advance;
+            x = start_x + (column / 4 + 1) * 4 * font->advance;
+            continue;
+        }
+        if((c & 0xC0) == 0x80) {
+            // UTF-8 continuation byte, the lead byte already drew a placeholder
+            continue;
+        }
+        if(c >= 128 || c < ' ') c = '?';
+
+        Glyph* glyph = &font->glyphs[c];
+        if(glyph->width > 0 && glyph->height > 0) {
+            auto placement = arena_push_struct(list->glyph_arena, SR_Glyph_Placement);
+            *placement = {x + glyph->x_offset, baseline + glyph->y_offset,
+                          glyph->x, glyph->y, glyph->width, glyph->height};
+            if(!run) {
+                run = push_command(list, SR_COMMAND_GLYPH_RUN, SR_Rect {});
+                run->color = color;
+                run->source = &font->atlas;
+                run->glyphs = placement;
+            }
+            run->glyph_count++;
+            run->bounds = sr_union(run->bounds, SR_Rect {placement->x, placement->y,
+                                                         placement->width, placement->height});
+        }
+        x += glyph->advance;
+        if(x >= list->width) break;
+    }
+    return x;
+}
+
+int sr_overlaps(SR_Rect a, SR_Rect b) {
+    SR_Rect both = sr_intersect(a, b);
+    return both.width && both.height;
+}
+
+int sr_rect_equal(SR_Rect a, SR_Rect b) {
+    return a.x == b.x && a.y == b.y && a.width == b.width && a.height == b.height;
+}
+
+// Whether into and command can be drawn as one, and if so makes into that
+// one. command has to come right after into, nothing in between may
+// overlap it.
+int merge_command(SR_Command_List* list, SR_Command* into, SR_Command* command) {
+    if(into->kind != command->kind) return 0;
+    if(!sr_rect_equal(into->clip, command->clip)) return 0;
+    if(into->color.value32 != command->color.value32) return 0;
+
+    SR_Rect a = into->bounds;
+    SR_Rect b = command->bounds;
+    switch(command->kind) {
+    case SR_COMMAND_FILL: {
+        // Only when the two make a rectangle again, side by side or on top
+        // of each other
+        int side_by_side = a.y == b.y && a.height == b.height &&
+                           (a.x + a.width == b.x || b.x + b.width == a.x);
+        int stacked = a.x == b.x && a.width == b.width &&
+                      (a.y + a.height == b.y || b.y + b.height == a.y);
+        if(!side_by_side && !stacked) return 0;
+    } break;
+    case SR_COMMAND_GLYPH_RUN: {
+        if(into->source != command->source) return 0;
+        u32 glyph_count = into->glyph_count + command->glyph_count;
+        if(glyph_count > SR_MAX_RUN_GLYPHS) return 0;
+        if(into->glyphs + into->glyph_count != command->glyphs) {
+            // Not next to each other, so both get copied to the end
+            auto glyphs = arena_push_array(list->glyph_arena, SR_Glyph_Placement, glyph_count);
+            memcpy(glyphs, into->glyphs, into->glyph_count * sizeof(SR_Glyph_Placement));
+            memcpy(glyphs + into->glyph_count, command->glyphs,
+                   command->glyph_count * sizeof(SR_Glyph_Placement));
+            into->glyphs = glyphs;
+        }
+        into->glyph_count = glyph_count;
+    } break;
+    default: return 0;
+    }
+    into->bounds = sr_union(a, b);
+    return 1;
+}
+
+// Runs once the list is recorded and before it's binned, rewrites it in
+// place:
+// - resolves clip pushes and pops into a clip on every command, and drops
+//   commands that end up drawing nothing
+// - drops everything under the last fill that covers the whole frame
+// - moves commands back past ones they don't overlap to merge them into an
+//   earlier compatible one, so consecutive lines of text become a few runs
+//   instead of one command per line. Overlapping commands never trade
+//   places, so the picture stays the same.
+void optimize_command_list(SR_Command_List* list) {
+    SR_Rect frame = {0, 0, list->width, list->height};
+    SR_Rect clips[SR_MAX_CLIP_DEPTH];
+    s32 clip_depth = 0;
+    clips[0] = frame;
+
+    usize count = 0;
+    for(usize i = 0; i < list->count; i++) {
+        SR_Command command = list->commands[i];
+        if(command.kind == SR_COMMAND_PUSH_CLIP) {
+            assert(clip_depth + 1 < SR_MAX_CLIP_DEPTH, "Clips nested too deep");
+            clips[clip_depth + 1] = sr_intersect(clips[clip_depth], command.bounds);
+            clip_depth++;
+            continue;
+        }
+        if(command.kind == SR_COMMAND_POP_CLIP) {
+            assert(clip_depth > 0, "Popped a clip that wasn't pushed");
+            clip_depth--;
+            continue;
+        }
+
+        command.clip = clips[clip_depth];
+        // Binning and merging only care about what's actually drawn. A
+        // blit's source moves along with its corner.
+        SR_Rect bounds = sr_intersect(command.bounds, command.clip);
+        if(!bounds.width || !bounds.height) continue;
+        command.source_x += bounds.x - command.bounds.x;
+        command.source_y += bounds.y - command.bounds.y;
+        command.bounds = bounds;
+
+        if(command.kind == SR_COMMAND_FILL && sr_rect_equal(command.bounds, frame)) {
+            count = 0;
+        }
+
+        int merged = 0;
+        usize window_start = count > SR_MERGE_WINDOW ? count - SR_MERGE_WINDOW : 0;
+        for(usize j = count; j > window_start; j--) {
+            SR_Command* earlier = &list->commands[j - 1];
+            if(merge_command(list, earlier, &command)) {
+                merged = 1;
+                break;
+            }
+            if(sr_overlaps(earlier->bounds, command.bounds)) break;
+        }
+        if(!merged) list->commands[count++] = command;
+    }
+    assert(clip_depth == 0, "Clip pushed but never popped");
+    list->count = count;
+}
+
+void execute_command(SR_Frame_Buffer* frame_buffer, SR_Rect clip, SR_Command* command) {
+    clip = sr_intersect(clip, command->clip);
+    SR_Rect bounds = command->bounds;
+    switch(command->kind) {
+    case SR_COMMAND_FILL: {
+        fill_box_clipped(frame_buffer, clip, bounds.x, bounds.y, bounds.width, bounds.height,
+                         command->color);
+    } break;
+    case SR_COMMAND_BLIT: {
+        blit_clipped(frame_buffer, clip, bounds.x, bounds.y, command->source,
+                     command->source_x, command->source_y, bounds.width, bounds.height);
+    } break;
+    case SR_COMMAND_GLYPH_RUN: {
+        for(u32 i = 0; i < command->glyph_count; i++) {
+            SR_Glyph_Placement* glyph = &command->glyphs[i];
+            blit_glyph_clipped(frame_buffer, clip, glyph->x, glyph->y, command->source,
+                               glyph->source_x, glyph->source_y, glyph->width, glyph->height,
+                               command->color);
+        }
+    } break;
+    default: {
+        assert(0, "Clips are resolved before execution");
+    } break;
+    }
+}
+
+// Tiled renderer
+//
+// The frame is cut into 64x64 tiles and every command gets binned into the
+// tiles its bounds overlap. Then workers take tiles one at a time and run
+// the tile's commands clipped to it, in recording order. A tile is 16KB
+// of pixels, so it stays in cache while everything that covers it gets
+// drawn, and since tiles don't share pixels the workers don't have to
+// agree on anything but who takes the next one.
+#define SR_TILE_SIZE 64
+#define SR_MAX_WORKERS 16
+
+struct SR_Tile_Job {
+    SR_Frame_Buffer* frame_buffer;
+    SR_Command_List* list;
+    s32 tiles_x, tiles_y;
+    // Commands of tile i are tile_commands[tile_starts[i]..tile_starts[i + 1]]
+    u32* tile_starts;
+    u32* tile_commands;
+    // Only pixels inside these get drawn, the rest keeps what it had
+    SR_Rect* damage;
+    u32 damage_count;
+    // Both accessed atomically
+    u32 next_tile;
+    u32 done_tiles;
+};
+
+struct SR_Worker_Pool {
+    pthread_t threads[SR_MAX_WORKERS];
+    s32 worker_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    // Goes up with every job, under the mutex
+    u64 generation;
+    SR_Tile_Job* job;
+    // Workers still holding on to the job
+    s32 busy_count;
+};
+
+void rasterize_tiles(SR_Tile_Job* job) {
+    u32 tile_count = job->tiles_x * job->tiles_y;
+    while(true) {
+        u32 tile = __atomic_fetch_add(&job->next_tile, 1, __ATOMIC_RELAXED);
+        if(tile >= tile_count) break;
+
+        SR_Rect tile_rect = {(s32)(tile % job->tiles_x) * SR_TILE_SIZE,
+                             (s32)(tile / job->tiles_x) * SR_TILE_SIZE, SR_TILE_SIZE, SR_TILE_SIZE};
+        for(u32 d = 0; d < job->damage_count; d++) {
+            SR_Rect clip = sr_intersect(tile_rect, job->damage[d]);
+            if(!clip.width || !clip.height) continue;
+            for(u32 i = job->tile_starts[tile]; i < job->tile_starts[tile + 1]; i++) {
+                execute_command(job->frame_buffer, clip,
+                                &job->list->commands[job->tile_commands[i]]);
+            }
+        }
+        __atomic_fetch_add(&job->done_tiles, 1, __ATOMIC_RELEASE);
+    }
+}
+
+void* sr_worker_proc(void* data) {
+    auto pool = (SR_Worker_Pool*)data;
+    u64 generation = 0;
+    while(true) {
+        pthread_mutex_lock(&pool->mutex);
+        while(pool->generation == generation) pthread_cond_wait(&pool->wake, &pool->mutex);
+        generation = pool->generation;
+        SR_Tile_Job* job = pool->job;
+        pthread_mutex_unlock(&pool->mutex);
+
+        rasterize_tiles(job);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->busy_count--;
+        if(!pool->busy_count) pthread_cond_signal(&pool->done);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    return 0;
+}
+
+// One worker less than there are cores, the render thread helps out
+void start_worker_pool(SR_Worker_Pool* pool) {
+    *pool = {};
+    pthread_mutex_init(&pool->mutex, 0);
+    pthread_cond_init(&pool->wake, 0);
+    pthread_cond_init(&pool->done, 0);
+    long core_count = sysconf(_SC_NPROCESSORS_ONLN);
+    pool->worker_count = std::min(std::max((s32)core_count - 1, 0), SR_MAX_WORKERS);
+    for(s32 i = 0; i < pool->worker_count; i++) {
+        int err = pthread_create(&pool->threads[i], 0, sr_worker_proc, pool);
+        assert(!err, "Couldn't start a render worker");
+    }
+}
+
+// Optimizes the list, bins the commands into tiles on the arena and
+// rasterizes them on the pool, returns when the whole frame is done. Only
+// draws inside the damage rectangles, which must not overlap.
+void execute_command_list(SR_Frame_Buffer* frame_buffer, SR_Command_List* list,
+                          SR_Worker_Pool* pool, Arena* arena,
+                          SR_Rect* damage, u32 damage_count) {
+    SR_Tile_Job job = {};
+    job.frame_buffer = frame_buffer;
+    job.list = list;
+    job.damage = damage;
+    job.damage_count = damage_count;
+    job.tiles_x = (frame_buffer->width + SR_TILE_SIZE - 1) / SR_TILE_SIZE;
+    job.tiles_y = (frame_buffer->height + SR_TILE_SIZE - 1) / SR_TILE_SIZE;
+    u32 tile_count = job.tiles_x * job.tiles_y;
+    if(!tile_count) return;
+    optimize_command_list(list);
+
+    // Tiles without damage get no commands at all
+    auto tile_damaged = arena_push_array(arena, u8, tile_count);
+    for(u32 tile = 0; tile < tile_count; tile++) {
+        SR_Rect tile_rect = {(s32)(tile % job.tiles_x) * SR_TILE_SIZE,
+                             (s32)(tile / job.tiles_x) * SR_TILE_SIZE, SR_TILE_SIZE, SR_TILE_SIZE};
+        tile_damaged[tile] = 0;
+        for(u32 d = 0; d < damage_count; d++) {
+            tile_damaged[tile] |= sr_overlaps(tile_rect, damage[d]);
+        }
+    }
+
+    // Count per tile, turn that into starts, then fill in. Commands keep
+    // their order within a tile, so later ones still draw over earlier ones.
+    job.tile_starts = arena_push_array(arena, u32, tile_count + 1);
+    memset(job.tile_starts, 0, (tile_count + 1) * sizeof(u32));
+    SR_Rect frame = {0, 0, frame_buffer->width, frame_buffer->height};
+    for(int pass = 0; pass < 2; pass++) {
+        for(usize i = 0; i < list->count; i++) {
+            SR_Rect bounds = sr_intersect(list->commands[i].bounds, frame);
+            if(!bounds.width || !bounds.height) continue;
+            s32 tile_x0 = bounds.x / SR_TILE_SIZE;
+            s32 tile_y0 = bounds.y / SR_TILE_SIZE;
+            s32 tile_x1 = (bounds.x + bounds.width - 1) / SR_TILE_SIZE;
+            s32 tile_y1 = (bounds.y + bounds.height - 1) / SR_TILE_SIZE;
+            for(s32 tile_y = tile_y0; tile_y <= tile_y1; tile_y++) {
+                for(s32 tile_x = tile_x0; tile_x <= tile_x1; tile_x++) {
+                    u32 tile = tile_y * job.tiles_x + tile_x;
+                    if(!tile_damaged[tile]) continue;
+                    if(pass == 0) job.tile_starts[tile + 1]++;
+                    else job.tile_commands[job.tile_starts[tile]++] = i;
+                }
+            }
+        }
+        if(pass == 0) {
+            for(u32 tile = 0; tile < tile_count; tile++) {
+                job.tile_starts[tile + 1] += job.tile_starts[tile];
+            }
+            job.tile_commands = arena_push_array(arena, u32, job.tile_starts[tile_count]);
+        } else {
+            // Filling in moved every start up to the next tile's
+            for(u32 tile = tile_count; tile > 0; tile--) {
+                job.tile_starts[tile] = job.tile_starts[tile - 1];
+            }
+            job.tile_starts[0] = 0;
+        }
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->job = &job;
+    pool->busy_count = pool->worker_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+
+    rasterize_tiles(&job);
+
+    // The job lives on our stack, so every worker has to be done with it,
+    // not just with the tiles
+    pthread_mutex_lock(&pool->mutex);
+    while(pool->busy_count) pthread_cond_wait(&pool->done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+    assert(job.done_tiles == tile_count);
+}
+
+// Puts the frame buffer, or a view, in the window or a pixmap with its
+// top-left corner at x, y, which are X's top-left based coordinates.
+// XImage goes down the rows, so it has to be laid out top-down.
+void present(SR_Frame_Buffer frame_buffer, Drawable target, s32 x, s32 y) {
+    if((frame_buffer.width <= 0) || (frame_buffer.height <= 0)) {
+        return;
+    }
+    assert(frame_buffer.stride < 0, "Can't present a bottom-up frame buffer");
+
+    // We're manually creating XImage here instead of calling
+    // XCreateImage so we manually manage its memory instead of letting
+    // xlib to allocate it on the heap with calloc.
+    XImage image = {};
+    image.width = frame_buffer.width;
+    image.height = frame_buffer.height;
+    image.format = ZPixmap;
+    image.byte_order = ImageByteOrder(display);
+    image.bitmap_unit = BitmapUnit(display);
+    image.bitmap_bit_order = BitmapBitOrder(display);
+    image.red_mask = visinfo.visual->red_mask;
+    image.green_mask = visinfo.visual->green_mask;
+    image.blue_mask = visinfo.visual->blue_mask;
+    image.xoffset = 0;
+    image.bitmap_pad = 32;
+    image.depth = visinfo.depth;
+    image.data = (char*)sr_row(&frame_buffer, frame_buffer.height - 1);
+    image.bits_per_pixel = 32;
+    // Views are narrower than their rows
+    image.bytes_per_line = -frame_buffer.stride * sizeof(rgba8);
+
+    GC default_gc = DefaultGC(display, default_screen);
+    assert(XInitImage(&image), "Fucked up XImage initializationi, dawg");
+    XPutImage(display, target, default_gc, &image,
+              0, 0, x, y, image.width, image.height);
+}
+
+void set_size_hint(Display* display, Window window,
+                   u32 min_width, u32 min_height,
+                   u32 max_width, u32 max_height) {
+    XSizeHints hints = {};
+    if(min_width > 0 && min_height > 0) hints.flags |= PMinSize;
+    if(max_width > 0 && max_height > 0) hints.flags |= PMaxSize;
+
+    hints.min_width = min_width;
+    hints.min_height = min_height;
+    hints.max_width = max_width;
+    hints.max_height = max_height;
+
+    XSetWMNormalHints(display, window, &hints);
+}
+
+// X setup
+//
+// Everything that needs an answer from the server costs a round trip, and
+// over a remote connection those are what startup is made of. So the
+// atoms and extensions we need are asked for once, all together, and the
+// rest of the code uses what came back.
+//
+// Xlib waits for each reply before sending the next request. XInternAtoms
+// at least does all the atoms in one go. Built with SCAME_XCB, the
+// requests go out over Xlib's XCB connection right after the window is
+// created, and the replies are collected after the input method setup,
+// which has round trips of its own to overlap with.
+
+// Same order as x_atom_names
+struct X_Atoms {
+    Atom WM_DELETE_WINDOW;
+    Atom _NET_WM_SYNC_REQUEST;
+    Atom _NET_WM_SYNC_REQUEST_COUNTER;
+    Atom _NET_WM_STATE;
+    Atom _NET_WM_STATE_MAXIMIZED_HORZ;
+    Atom _NET_WM_STATE_MAXIMIZED_VERT;
+};
+
+const char* x_atom_names[] = {
+    "WM_DELETE_WINDOW",
+    "_NET_WM_SYNC_REQUEST",
+    "_NET_WM_SYNC_REQUEST_COUNTER",
+    "_NET_WM_STATE",
+    "_NET_WM_STATE_MAXIMIZED_HORZ",
+    "_NET_WM_STATE_MAXIMIZED_VERT",
+};
+static_assert(sizeof(X_Atoms) == ARRAY_COUNT(x_atom_names) * sizeof(Atom),
+              "x_atom_names is missing some of X_Atoms");
+
+X_Atoms atoms;
+
+struct X_Setup {
+    // Major opcode of the Present extension, 0 when the server doesn't
+    // have it
+    int present_opcode;
+#if defined(SCAME_XCB)
+    xcb_intern_atom_cookie_t atom_cookies[ARRAY_COUNT(x_atom_names)];
+    xcb_query_extension_cookie_t present_cookie;
+#endif
+};
+
+// Sends the requests, doesn't wait for anything
+void start_x_setup(X_Setup* setup) {
+    *setup = {};
+#if defined(SCAME_XCB)
+    xcb_connection_t* connection = XGetXCBConnection(display);
+    for(u32 i = 0; i < ARRAY_COUNT(x_atom_names); i++) {
+        setup->atom_cookies[i] = xcb_intern_atom(connection, 0, strlen(x_atom_names[i]),
+                                                 x_atom_names[i]);
+    }
+    setup->present_cookie = xcb_query_extension(connection, strlen(PRESENT_NAME), PRESENT_NAME);
+    xcb_flush(connection);
+#endif
+}
+
+// Waits for the answers, fills in atoms
+void finish_x_setup(X_Setup* setup) {
+    Atom* atom_array = (Atom*)&atoms;
+#if defined(SCAME_XCB)
+    xcb_connection_t* connection = XGetXCBConnection(display);
+    for(u32 i = 0; i < ARRAY_COUNT(x_atom_names); i++) {
+        auto reply = xcb_intern_atom_reply(connection, setup->atom_cookies[i], 0);
+        atom_array[i] = reply ? reply->atom : None;
+        free(reply);
+    }
+    auto present = xcb_query_extension_reply(connection, setup->present_cookie, 0);
+    setup->present_opcode = present && present->present ? present->major_opcode : 0;
+    free(present);
+#else
+    if(!XInternAtoms(display, (char**)x_atom_names, ARRAY_COUNT(x_atom_names), False,
+                     atom_array)) {
+        printf("Couldn't intern atoms\n");
+    }
+    int event_base, error_base;
+    if(!XQueryExtension(display, PRESENT_NAME, &setup->present_opcode,
+                        &event_base, &error_base)) {
+        setup->present_opcode = 0;
+    }
+#endif
+}
+
+Status toggle_maximize(Display* display, Window window) {
+    XClientMessageEvent ev = {};
+    if(atoms._NET_WM_STATE == None) return 0;
+
+    ev.type = ClientMessage;
+    ev.format = 32;
+    ev.window = window;
+    ev.message_type = atoms._NET_WM_STATE;
+    ev.data.l[0] = 2; // _NET_WM_STATE_TOGGLE
+    ev.data.l[1] = atoms._NET_WM_STATE_MAXIMIZED_HORZ;
+    ev.data.l[2] = atoms._NET_WM_STATE_MAXIMIZED_VERT;
+    ev.data.l[3] = 1;
+
+    return XSendEvent(display, DefaultRootWindow(display), False,
+                      SubstructureNotifyMask,
+                      (XEvent*)&ev);
+}
+
+struct Mapped_File {
+    int fd;
+    u8_array data;
+    // Address space reserved at data.base, the file can be followed in
+    // place as long as it doesn't grow past that
+    usize capacity;
+    // The data was read into private memory instead of being mapped
+    int is_copy;
+};
+
+// Shared file mappings and truncation
+//
+// If someone truncates a file we have mapped, touching the pages past the
+// new end gets us a SIGBUS. Copying everything into private memory would
+// avoid that, but for a multi-gigabyte log that's exactly what mapping is
+// supposed to save us from. Instead mappings get registered here, and the
+// SIGBUS handler puts zero pages over the part of the mapping that's gone
+// and lets the access run again. The text past the cut reads as zeros and
+// the mapping is flagged, so the UI can tell the user.
+#define MAX_GUARDED_MAPPINGS 64
+
+struct Guarded_Mapping {
+    u8* base;
+    // Accessed atomically, grows when we follow a file that's appended to
+    usize count;
+    // Accessed atomically, set from the signal handler
+    int truncated;
+};
+
+Guarded_Mapping guarded_mappings[MAX_GUARDED_MAPPINGS];
+// Accessed atomically, entries below it are complete
+int guarded_mapping_count;
+pthread_once_t guarded_mapping_handler_once = PTHREAD_ONCE_INIT;
+
+void guarded_mapping_sigbus_handler(int signal_number, siginfo_t* info, void*) {
+    auto address = (u8*)info->si_addr;
+    int count = __atomic_load_n(&guarded_mapping_count, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < count; i++) {
+        Guarded_Mapping* mapping = &guarded_mappings[i];
+        usize mapping_count = __atomic_load_n(&mapping->count, __ATOMIC_ACQUIRE);
+        if(address < mapping->base || address >= mapping->base + mapping_count) continue;
+
+        // Everything from the faulting page to the end of the mapping is
+        // likely gone too, cover all of it at once instead of taking a
+        // signal per page. mmap is a plain syscall, fine in a handler.
+        auto page = (u8*)((usize)address & ~(usize)(PLATFORM_PAGE_SIZE - 1));
+        void* zeros = mmap(page, mapping->base + mapping_count - page, PROT_READ,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if(zeros == MAP_FAILED) break;
+        __atomic_store_n(&mapping->truncated, 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    // Not ours, die like we would have without the handler
+    signal(signal_number, SIG_DFL);
+    raise(signal_number);
+}
+
+void install_guarded_mapping_handler() {
+    struct sigaction action = {};
+    action.sa_sigaction = guarded_mapping_sigbus_handler;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    int err = sigaction(SIGBUS, &action, 0);
+    assert(!err, "Couldn't install the SIGBUS handler");
+}
+
+// Entries are never removed, unmapping sets their count to 0 and a later
+// registration can take the slot. The handler may look at a slot while it's
+// being reused, but with count 0 it doesn't match anything.
+void guard_mapping(u8* base, usize count) {
+    pthread_once(&guarded_mapping_handler_once, install_guarded_mapping_handler);
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&mutex);
+    int index = 0;
+    while(index < guarded_mapping_count &&
+          __atomic_load_n(&guarded_mappings[index].count, __ATOMIC_ACQUIRE)) {
+        index++;
+    }
+    assert(index < MAX_GUARDED_MAPPINGS, "Too many mapped files");
+    Guarded_Mapping* mapping = &guarded_mappings[index];
+    mapping->base = base;
+    __atomic_store_n(&mapping->truncated, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&mapping->count, count, __ATOMIC_RELEASE);
+    if(index == guarded_mapping_count) {
+        __atomic_store_n(&guarded_mapping_count, index + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+void resize_guarded_mapping(u8* base, usize count) {
+    int mapping_count = __atomic_load_n(&guarded_mapping_count, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < mapping_count; i++) {
+        if(guarded_mappings[i].base != base) continue;
+        __atomic_store_n(&guarded_mappings[i].count, count, __ATOMIC_RELEASE);
+        return;
+    }
+}
+
+// Whether any part of [base, base + count) was found cut off. Memory that
+// isn't a registered mapping never is.
+int mapping_is_truncated(u8* base, usize count) {
+    int mapping_count = __atomic_load_n(&guarded_mapping_count, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < mapping_count; i++) {
+        Guarded_Mapping* mapping = &guarded_mappings[i];
+        usize mapping_count = __atomic_load_n(&mapping->count, __ATOMIC_ACQUIRE);
+        if(base + count <= mapping->base || base >= mapping->base + mapping_count) continue;
+        if(__atomic_load_n(&mapping->truncated, __ATOMIC_ACQUIRE)) return 1;
+    }
+    return 0;
+}
+
+// When the kernel itself reads a cut off page, e.g. in write(), there's no
+// SIGBUS, the syscall just fails with EFAULT. Touching every page from user
+// space first lets the handler patch them up before the syscall sees them.
+void touch_guarded_pages(u8* base, usize count) {
+    u8 sink = 0;
+    for(usize i = 0; i < count; i += PLATFORM_PAGE_SIZE) sink += base[i];
+    if(count) sink += base[count - 1];
+    __asm__ volatile("" :: "r"(sink));
+}
+
+#define MAP_WILL_NEED_SIZE (1024 * 1024)
+
+// Keeps the descriptor open, so we can later copy unchanged parts of the
+// file around in the kernel instead of going through the mapping
+// Returns 0 if the file can't be opened or mapped
+int platform_open_mapped_file(cstring file_path, Mapped_File* result) {
+    *result = {};
+    int fd = open(file_path, O_RDONLY);
+    if(fd < 0) return 0;
+
+    struct stat statbuf;
+    if(fstat(fd, &statbuf) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    // mmap doesn't like empty mappings
+    static u8 empty_file;
+    u8* memory = &empty_file;
+    if(statbuf.st_size > 0) {
+        memory = (u8*)mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(memory == MAP_FAILED) {
+            close(fd);
+            return 0;
+        }
+        guard_mapping(memory, statbuf.st_size);
+
+        // Callers read from the front, so start the readahead for that part.
+        // Unlike MAP_POPULATE this doesn't wait for it, and doesn't fault in
+        // all of a file that can be gigabytes
+        platform_advise(memory, std::min((usize)statbuf.st_size, (usize)MAP_WILL_NEED_SIZE),
+                        ACCESS_WILL_NEED);
+    }
+
+    result->fd = fd;
+    result->data.base = memory;
+    result->data.count = statbuf.st_size;
+    result->capacity = statbuf.st_size;
+    return 1;
+}
+
+Mapped_File platform_map_file(cstring file_path) {
+    Mapped_File result;
+    assert(platform_open_mapped_file(file_path, &result), "Couldn't open the file %s", file_path);
+    return result;
+}
+
+void platform_close_mapped_file(Mapped_File* file) {
+    if(file->data.count) {
+        resize_guarded_mapping(file->data.base, 0);
+        munmap(file->data.base, file->data.count);
+    }
+    close(file->fd);
+    *file = {};
+}
+
+u8_array platform_read_entire_file(cstring file_path) {
+    auto file = platform_map_file(file_path);
+    close(file.fd);
+    return file.data;
+}
+
+usize count_newlines(u8* base, usize count) {
+    usize result = 0;
+    usize i = 0;
+
+    // SSE2 is always there on x86_64. Matches are subtracted from the
+    // accumulator (they are 0xFF == -1) and flushed with sad before any of the
+    // 8 bit lanes can overflow.
+    __m128i newline = _mm_set1_epi8('\n');
+    while(count - i >= 16) {
+        __m128i accumulator = _mm_setzero_si128();
+        usize batch_end = i + std::min((count - i) & ~(usize)15, (usize)255 * 16);
+        for(; i < batch_end; i += 16) {
+            __m128i chunk = _mm_loadu_si128((__m128i*)(base + i));
+            accumulator = _mm_sub_epi8(accumulator, _mm_cmpeq_epi8(chunk, newline));
+        }
+        __m128i sums = _mm_sad_epu8(accumulator, _mm_setzero_si128());
+        result += _mm_cvtsi128_si64(sums) + _mm_extract_epi16(sums, 4);
+    }
+
+    for(; i < count; i++) {
+        result += base[i] == '\n';
+    }
+    return result;
+}
+
+// UTF-8
+//
+// Everything here works on raw bytes as they come from files or the input
+// method. The vectorized versions take an all-ASCII shortcut per block, which
+// is what most source code and logs look like.
+
+// Returns the length of the sequence and 0 if it's malformed (overlong,
+// surrogate, out of range or truncated).
+usize utf8_decode(u8* at, usize left, u32* code_point) {
+    u8 c = at[0];
+    if(c < 0x80) {
+        *code_point = c;
+        return 1;
+    }
+
+    usize length;
+    u32 result;
+    u32 min_value;
+    if((c & 0xE0) == 0xC0) {
+        length = 2;
+        result = c & 0x1F;
+        min_value = 0x80;
+    } else if((c & 0xF0) == 0xE0) {
+        length = 3;
+        result = c & 0x0F;
+        min_value = 0x800;
+    } else if((c & 0xF8) == 0xF0) {
+        length = 4;
+        result = c & 0x07;
+        min_value = 0x10000;
+    } else {
+        return 0;
+    }
+
+    if(left < length) return 0;
+    for(usize i = 1; i < length; i++) {
+        if((at[i] & 0xC0) != 0x80) return 0;
+        result = (result << 6) | (at[i] & 0x3F);
+    }
+
+    if(result < min_value) return 0;
+    if(result > 0x10FFFF) return 0;
+    if(result >= 0xD800 && result <= 0xDFFF) return 0;
+
+    *code_point = result;
+    return length;
+}
+
+int utf8_validate_scalar(u8* base, usize count) {
+    usize i = 0;
+    while(i < count) {
+        if(base[i] < 0x80) {
+            i++;
+            continue;
+        }
+        u32 code_point;
+        usize length = utf8_decode(base + i, count - i, &code_point);
+        if(!length) return 0;
+        i += length;
+    }
+    return 1;
+}
+
+int utf8_is_ascii_block(u8* at) {
+    __m128i a = _mm_loadu_si128((__m128i*)(at + 0));
+    __m128i b = _mm_loadu_si128((__m128i*)(at + 16));
+    __m128i c = _mm_loadu_si128((__m128i*)(at + 32));
+    __m128i d = _mm_loadu_si128((__m128i*)(at + 48));
+    __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+    return _mm_movemask_epi8(any) == 0;
+}
+
+// Length of the ASCII run at the start of the text
+usize utf8_ascii_prefix_length(u8_array text) {
+    usize i = 0;
+    while(text.count - i >= 64 && utf8_is_ascii_block(text.base + i)) {
+        i += 64;
+    }
+    while(text.count - i >= 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((__m128i*)(text.base + i)));
+        if(mask) return i + __builtin_ctz(mask);
+        i += 16;
+    }
+    while(i < text.count && text.base[i] < 0x80) i++;
+    return i;
+}
+
+// The "lookup" algorithm from Keiser and Lemire, "Validating UTF-8 In Less
+// Than One Instruction Per Byte". Every error is a combination of the high
+// nibble of the previous byte and both nibbles of the current one, which
+// gives us three table lookups per 16 bytes. It needs pshufb, so SSSE3.
+#define UTF8_TOO_SHORT      (1 << 0) // 11______ 0_______
+#define UTF8_TOO_LONG       (1 << 1) // 0_______ 10______
+#define UTF8_OVERLONG_3     (1 << 2) // 11100000 100_____
+#define UTF8_TOO_LARGE      (1 << 3) // 11110100 1001____
+#define UTF8_SURROGATE      (1 << 4) // 11101101 101_____
+#define UTF8_OVERLONG_2     (1 << 5) // 1100000_ 10______
+#define UTF8_TOO_LARGE_1000 (1 << 6) // 11110101 1000____
+#define UTF8_OVERLONG_4     (1 << 6) // 11110000 1000____
+#define UTF8_TWO_CONTS      (1 << 7) // 10______ 10______
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+u8 utf8_byte_1_high_table[16] = {
+    // 0_______ ________ <ASCII in byte 1>
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    // 10______ ________ <continuation in byte 1>
+    UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+    // 1100____ ________ <two byte lead in byte 1>
+    UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+    // 1101____ ________ <two byte lead in byte 1>
+    UTF8_TOO_SHORT,
+    // 1110____ ________ <three byte lead in byte 1>
+    UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+    // 1111____ ________ <four+ byte lead in byte 1>
+    UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+};
+
+u8 utf8_byte_1_low_table[16] = {
+    // ____0000 ________
+    UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+    // ____0001 ________
+    UTF8_CARRY | UTF8_OVERLONG_2,
+    // ____001_ ________
+    UTF8_CARRY,
+    UTF8_CARRY,
+    // ____0100 ________
+    UTF8_CARRY | UTF8_TOO_LARGE,
+    // ____0101 ________
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    // ____011_ ________
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    // ____1___ ________
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    // ____1101 ________
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+};
+
+u8 utf8_byte_2_high_table[16] = {
+    // ________ 0_______ <ASCII in byte 2>
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    // ________ 1000____
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+    UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+    // ________ 1001____
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+    // ________ 101_____
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE  | UTF8_TOO_LARGE,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE  | UTF8_TOO_LARGE,
+    // ________ 11______
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+};
+
+// Anything greater than that at the end of a block starts a sequence that
+// continues in the next block
+u8 utf8_incomplete_max_table[16] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1,
+};
+
+__attribute__((target("ssse3")))
+__m128i utf8_block_errors(__m128i input, __m128i prev_input) {
+    __m128i low_nibble = _mm_set1_epi8(0x0F);
+    __m128i prev1 = _mm_alignr_epi8(input, prev_input, 16 - 1);
+
+    __m128i byte_1_high = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)utf8_byte_1_high_table),
+                                           _mm_and_si128(_mm_srli_epi16(prev1, 4), low_nibble));
+    __m128i byte_1_low = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)utf8_byte_1_low_table),
+                                          _mm_and_si128(prev1, low_nibble));
+    __m128i byte_2_high = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)utf8_byte_2_high_table),
+                                           _mm_and_si128(_mm_srli_epi16(input, 4), low_nibble));
+
+    __m128i special_cases = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+    // Third and fourth bytes of 3 and 4 byte sequences have to be
+    // continuations, which is the only case where TWO_CONTS is not an error
+    __m128i prev2 = _mm_alignr_epi8(input, prev_input, 16 - 2);
+    __m128i prev3 = _mm_alignr_epi8(input, prev_input, 16 - 3);
+    __m128i is_third_byte = _mm_subs_epu8(prev2, _mm_set1_epi8(0xE0 - 0x80));
+    __m128i is_fourth_byte = _mm_subs_epu8(prev3, _mm_set1_epi8(0xF0 - 0x80));
+    __m128i must_be_continuation = _mm_and_si128(_mm_or_si128(is_third_byte, is_fourth_byte),
+                                                 _mm_set1_epi8((char)0x80));
+
+    return _mm_xor_si128(must_be_continuation, special_cases);
+}
+
+// Non-zero if the block ends in the middle of a multi-byte sequence
+__m128i utf8_block_incomplete(__m128i input) {
+    return _mm_subs_epu8(input, _mm_loadu_si128((__m128i*)utf8_incomplete_max_table));
+}
+
+__attribute__((target("ssse3")))
+int utf8_validate_ssse3(u8* base, usize count) {
+    __m128i error = _mm_setzero_si128();
+    __m128i prev_input = _mm_setzero_si128();
+    __m128i prev_incomplete = _mm_setzero_si128();
+
+    usize i = 0;
+    for(; count - i >= 64; i += 64) {
+        __m128i a = _mm_loadu_si128((__m128i*)(base + i + 0));
+        __m128i b = _mm_loadu_si128((__m128i*)(base + i + 16));
+        __m128i c = _mm_loadu_si128((__m128i*)(base + i + 32));
+        __m128i d = _mm_loadu_si128((__m128i*)(base + i + 48));
+        __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if(_mm_movemask_epi8(any) == 0) {
+            // ASCII can't continue whatever the previous block started
+            error = _mm_or_si128(error, prev_incomplete);
+            prev_incomplete = _mm_setzero_si128();
+        } else {
+            error = _mm_or_si128(error, utf8_block_errors(a, prev_input));
+            error = _mm_or_si128(error, utf8_block_errors(b, a));
+            error = _mm_or_si128(error, utf8_block_errors(c, b));
+            error = _mm_or_si128(error, utf8_block_errors(d, c));
+            prev_incomplete = utf8_block_incomplete(d);
+        }
+        prev_input = d;
+    }
+    for(; count - i >= 16; i += 16) {
+        __m128i a = _mm_loadu_si128((__m128i*)(base + i));
+        error = _mm_or_si128(error, utf8_block_errors(a, prev_input));
+        prev_input = a;
+    }
+
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xFFFF) {
+        return 0;
+    }
+
+    // Whatever sequence crosses the end of the last full block, together with
+    // the leftover bytes, goes through the scalar path
+    usize tail_start = i;
+    while(tail_start > 0 && i - tail_start < 3 && (base[tail_start - 1] & 0xC0) == 0x80) {
+        tail_start--;
+    }
+    if(tail_start > 0 && base[tail_start - 1] >= 0xC0) tail_start--;
+
+    return utf8_validate_scalar(base + tail_start, count - tail_start);
+}
+
+int utf8_validate(u8_array text) {
+    static int has_ssse3 = __builtin_cpu_supports("ssse3");
+    if(has_ssse3) return utf8_validate_ssse3(text.base, text.count);
+
+    usize ascii = utf8_ascii_prefix_length(text);
+    return utf8_validate_scalar(text.base + ascii, text.count - ascii);
+}
+
+// Counts everything that is not a continuation byte, so for valid UTF-8 it's
+// the number of code points
+usize utf8_count_code_points(u8_array text) {
+    usize result = 0;
+    usize i = 0;
+
+    // Continuation bytes are 0x80..0xBF, which are the only ones less than
+    // or equal to 0xBF when compared as signed
+    __m128i last_continuation = _mm_set1_epi8((char)0xBF);
+    while(text.count - i >= 64) {
+        __m128i accumulator = _mm_setzero_si128();
+        usize batch_end = i + std::min((text.count - i) & ~(usize)63, (usize)63 * 64);
+        usize ascii_bytes = 0;
+        for(; i < batch_end; i += 64) {
+            u8* at = text.base + i;
+            if(utf8_is_ascii_block(at)) {
+                ascii_bytes += 64;
+                continue;
+            }
+            for(usize j = 0; j < 64; j += 16) {
+                __m128i chunk = _mm_loadu_si128((__m128i*)(at + j));
+                accumulator = _mm_sub_epi8(accumulator, _mm_cmpgt_epi8(chunk, last_continuation));
+            }
+        }
+        __m128i sums = _mm_sad_epu8(accumulator, _mm_setzero_si128());
+        result += _mm_cvtsi128_si64(sums) + _mm_extract_epi16(sums, 4) + ascii_bytes;
+    }
+
+    for(; i < text.count; i++) {
+        result += (text.base[i] & 0xC0) != 0x80;
+    }
+    return result;
+}
+
+// Column (in code points) of the offset within a line, for the common
+// all-ASCII line it's just a subtraction
+usize utf8_column(u8_array text, usize line_start, usize offset) {
+    u8_array line = {text.base + line_start, offset - line_start};
+    if(utf8_ascii_prefix_length(line) == line.count) return line.count;
+    return utf8_count_code_points(line);
+}
+
+// Cursor movement by code points, ASCII is one byte and done
+usize utf8_next(u8_array text, usize offset) {
+    if(offset >= text.count) return text.count;
+    if(text.base[offset] < 0x80) return offset + 1;
+    offset++;
+    while(offset < text.count && (text.base[offset] & 0xC0) == 0x80) offset++;
+    return offset;
+}
+
+usize utf8_previous(u8_array text, usize offset) {
+    if(offset == 0) return 0;
+    offset--;
+    if(text.base[offset] < 0x80) return offset;
+    for(int i = 0; i < 3 && offset > 0 && (text.base[offset] & 0xC0) == 0x80; i++) {
+        offset--;
+    }
+    return offset;
+}
+
+// Length of text without a code point that's cut off at its end, like the
+// last one of a file that's still being written
+usize utf8_complete_length(u8_array text) {
+    if(!text.count) return 0;
+    usize lead = utf8_previous(text, text.count);
+    u8 byte = text.base[lead];
+    usize length = byte >= 0xF0 ? 4 : byte >= 0xE0 ? 3 : byte >= 0xC0 ? 2 : 1;
+    return text.count - lead < length ? lead : text.count;
+}
+
+// Hashing
+//
+// Fast and good enough to tell whether text changed, nothing that has to
+// hold up against someone trying to collide it.
+#define HASH_PRIME_1 0x9E3779B185EBCA87ull
+#define HASH_PRIME_2 0xC2B2AE3D27D4EB4Full
+#define HASH_PRIME_32 0x9E3779B1u
+
+static u8 hash_secret[64] = {
+    0xab, 0x43, 0xae, 0x4e, 0x92, 0xdd, 0x81, 0x1f, 0x8c, 0xbb, 0x31, 0xba, 0x04, 0x05, 0x31, 0xfd,
+    0xbf, 0x0c, 0xae, 0xfe, 0x1a, 0x0b, 0x78, 0xa6, 0x28, 0x50, 0xae, 0x54, 0x25, 0xf4, 0xb8, 0x2a,
+    0x96, 0x52, 0x27, 0x42, 0xe1, 0xfd, 0xa5, 0xca, 0xc7, 0x12, 0x87, 0xe9, 0x17, 0x3a, 0xac, 0xf2,
+    0x32, 0x25, 0xc1, 0xcf, 0x65, 0xe2, 0xc6, 0x03, 0x84, 0x70, 0x7e, 0x58, 0x09, 0x28, 0x30, 0x3b,
+};
+
+u64 hash_mix(u64 a, u64 b) {
+    __uint128_t product = (__uint128_t)a * b;
+    return (u64)product ^ (u64)(product >> 64);
+}
+
+// Same shape as XXH3's long hash, but not compatible with it: 64 bytes per
+// step into four 2x64-bit SSE2 accumulators, each lane gets the data plus
+// the product of its keyed halves. Every 1KB the accumulators get scrambled
+// so the products don't lose entropy. Several bytes per cycle.
+u64 hash_bytes(u8* base, usize count) {
+    __m128i accumulators[4];
+    for(int i = 0; i < 4; i++) {
+        accumulators[i] = _mm_set_epi64x(HASH_PRIME_2 * (i + 1), HASH_PRIME_1 * (i + 1));
+    }
+    __m128i prime = _mm_set1_epi32(HASH_PRIME_32);
+
+    auto accumulate = [&](u8* stripe) {
+        for(int i = 0; i < 4; i++) {
+            __m128i data = _mm_loadu_si128((__m128i*)stripe + i);
+            __m128i key = _mm_loadu_si128((__m128i*)hash_secret + i);
+            __m128i keyed = _mm_xor_si128(data, key);
+            __m128i product = _mm_mul_epu32(keyed, _mm_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1)));
+            __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+            accumulators[i] = _mm_add_epi64(accumulators[i], _mm_add_epi64(product, swapped));
+        }
+    };
+
+    usize stripe_count = count / 64;
+    for(usize stripe = 0; stripe < stripe_count; stripe++) {
+        accumulate(base + stripe * 64);
+        if(stripe % 16 == 15) {
+            for(int i = 0; i < 4; i++) {
+                __m128i value = accumulators[i];
+                value = _mm_xor_si128(value, _mm_srli_epi64(value, 47));
+                value = _mm_xor_si128(value, _mm_loadu_si128((__m128i*)hash_secret + (3 - i)));
+                __m128i low = _mm_mul_epu32(value, prime);
+                __m128i high = _mm_mul_epu32(_mm_srli_epi64(value, 32), prime);
+                accumulators[i] = _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+            }
+        }
+    }
+
+    // The tail goes through the same path zero padded, the length is mixed
+    // in at the end so padding doesn't collide with actual zeros
+    usize tail_count = count % 64;
+    if(tail_count) {
+        alignas(16) u8 tail[64] = {};
+        memcpy(tail, base + stripe_count * 64, tail_count);
+        accumulate(tail);
+    }
+
+    alignas(16) u64 lanes[8];
+    for(int i = 0; i < 4; i++) _mm_store_si128((__m128i*)lanes + i, accumulators[i]);
+    u64 result = count * HASH_PRIME_1;
+    for(int i = 0; i < 8; i += 2) {
+        u64 key_low, key_high;
+        memcpy(&key_low, hash_secret + i * 8, 8);
+        memcpy(&key_high, hash_secret + i * 8 + 8, 8);
+        result += hash_mix(lanes[i] ^ key_low, lanes[i + 1] ^ key_high);
+    }
+    result ^= result >> 37;
+    result *= 0x165667919E3779F9ull;
+    result ^= result >> 32;
+    return result;
+}
+
+// Transcoding
+//
+// Internally text is always UTF-8 with LF line endings. Files in other
+// encodings or with CRLF are converted on load and converted back on save.
+// Both directions go through the file in chunks, so we never hold more than
+// the source and the result (or on save, the text and a couple of small
+// staging buffers).
+enum Text_Encoding {
+    TEXT_ENCODING_UTF8,
+    TEXT_ENCODING_UTF16LE,
+    TEXT_ENCODING_UTF16BE,
+    TEXT_ENCODING_LATIN1,
+};
+
+struct Text_Format {
+    Text_Encoding encoding;
+    int has_bom;
+    int crlf;
+};
+
+#define TRANSCODE_CHUNK_SIZE (64 * 1024)
+// Files bigger than that are only checked for valid UTF-8 at the start
+#define TEXT_FORMAT_FULL_CHECK_LIMIT (64 * 1024 * 1024)
+#define TEXT_FORMAT_SAMPLE_SIZE (1024 * 1024)
+#define TEXT_FORMAT_LINE_SAMPLE_SIZE (64 * 1024)
+
+int text_format_is_internal(Text_Format format) {
+    return format.encoding == TEXT_ENCODING_UTF8 && !format.has_bom && !format.crlf;
+}
+
+cstring text_encoding_name(Text_Encoding encoding) {
+    switch(encoding) {
+    case TEXT_ENCODING_UTF8: return (cstring)"UTF-8";
+    case TEXT_ENCODING_UTF16LE: return (cstring)"UTF-16LE";
+    case TEXT_ENCODING_UTF16BE: return (cstring)"UTF-16BE";
+    case TEXT_ENCODING_LATIN1: return (cstring)"Latin-1";
+    }
+    return (cstring)"?";
+}
+
+Text_Format detect_text_format(u8_array raw) {
+    Text_Format result = {};
+    u8* at = raw.base;
+    if(raw.count >= 3 && at[0] == 0xEF && at[1] == 0xBB && at[2] == 0xBF) {
+        result.encoding = TEXT_ENCODING_UTF8;
+        result.has_bom = 1;
+    } else if(raw.count >= 2 && at[0] == 0xFF && at[1] == 0xFE) {
+        result.encoding = TEXT_ENCODING_UTF16LE;
+        result.has_bom = 1;
+    } else if(raw.count >= 2 && at[0] == 0xFE && at[1] == 0xFF) {
+        result.encoding = TEXT_ENCODING_UTF16BE;
+        result.has_bom = 1;
+    } else {
+        u8_array sample = raw;
+        if(raw.count > TEXT_FORMAT_FULL_CHECK_LIMIT) {
+            // Don't fail the check because the sample cut a sequence in half
+            sample.count = TEXT_FORMAT_SAMPLE_SIZE;
+            while(sample.count > 0 && (sample.base[sample.count] & 0xC0) == 0x80) {
+                sample.count--;
+            }
+        }
+        result.encoding = utf8_validate(sample) ? TEXT_ENCODING_UTF8 : TEXT_ENCODING_LATIN1;
+    }
+
+    // Line endings go by the majority in the first TEXT_FORMAT_LINE_SAMPLE_SIZE
+    // bytes, a file can start with a LF line and be CRLF after that. Files
+    // that really are mixed end up with visible CRs in LF mode, or with
+    // every line CRLF once saved in CRLF mode.
+    usize lf_count = 0, crlf_count = 0;
+    usize sample_end = std::min(raw.count, (usize)TEXT_FORMAT_LINE_SAMPLE_SIZE);
+    if(result.encoding == TEXT_ENCODING_UTF16LE || result.encoding == TEXT_ENCODING_UTF16BE) {
+        int low = result.encoding == TEXT_ENCODING_UTF16LE ? 0 : 1;
+        for(usize i = 2; i + 1 < sample_end; i += 2) {
+            if(at[i + low] == '\n' && at[i + 1 - low] == 0) {
+                lf_count++;
+                crlf_count += i >= 4 && at[i - 2 + low] == '\r' && at[i - 1 - low] == 0;
+            }
+        }
+    } else {
+        for(u8* newline = at; (newline = (u8*)memchr(newline, '\n', at + sample_end - newline));
+            newline++) {
+            lf_count++;
+            crlf_count += newline > at && newline[-1] == '\r';
+        }
+    }
+    result.crlf = crlf_count > lf_count - crlf_count;
+
+    return result;
+}
+
+// Copies src to dest dropping the CR of every CRLF pair, returns the number
+// of bytes written. A CR at the very end is held back in pending_cr, since
+// the LF might be in the next chunk. dest may point at or before src, so it
+// can compact in place, but if a CR is pending it has to be at least one byte
+// before.
+usize crlf_to_lf(u8* dest, u8* src, usize count, int* pending_cr) {
+    usize written = 0;
+    usize i = 0;
+    if(*pending_cr && count) {
+        if(src[0] != '\n') dest[written++] = '\r';
+        *pending_cr = 0;
+    }
+
+    __m128i cr = _mm_set1_epi8('\r');
+    __m128i lf = _mm_set1_epi8('\n');
+    while(i + 17 <= count) {
+        __m128i chunk = _mm_loadu_si128((__m128i*)(src + i));
+        __m128i next = _mm_loadu_si128((__m128i*)(src + i + 1));
+        __m128i pairs = _mm_and_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(next, lf));
+        if(_mm_movemask_epi8(pairs) == 0) {
+            _mm_storeu_si128((__m128i*)(dest + written), chunk);
+            written += 16;
+            i += 16;
+            continue;
+        }
+
+        for(usize end = i + 16; i < end; i++) {
+            if(src[i] == '\r' && src[i + 1] == '\n') continue;
+            dest[written++] = src[i];
+        }
+    }
+
+    for(; i < count; i++) {
+        if(src[i] == '\r') {
+            if(i + 1 == count) {
+                *pending_cr = 1;
+                break;
+            }
+            if(src[i + 1] == '\n') continue;
+        }
+        dest[written++] = src[i];
+    }
+    return written;
+}
+
+// dest needs room for 2 * count bytes
+usize lf_to_crlf(u8* dest, u8* src, usize count) {
+    usize written = 0;
+    usize i = 0;
+
+    __m128i lf = _mm_set1_epi8('\n');
+    while(i + 16 <= count) {
+        __m128i chunk = _mm_loadu_si128((__m128i*)(src + i));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, lf)) == 0) {
+            _mm_storeu_si128((__m128i*)(dest + written), chunk);
+            written += 16;
+            i += 16;
+            continue;
+        }
+
+        for(usize end = i + 16; i < end; i++) {
+            if(src[i] == '\n') dest[written++] = '\r';
+            dest[written++] = src[i];
+        }
+    }
+
+    for(; i < count; i++) {
+        if(src[i] == '\n') dest[written++] = '\r';
+        dest[written++] = src[i];
+    }
+    return written;
+}
+
+usize utf8_encode(u8* dest, u32 code_point) {
+    if(code_point < 0x80) {
+        dest[0] = code_point;
+        return 1;
+    }
+    if(code_point < 0x800) {
+        dest[0] = 0xC0 | (code_point >> 6);
+        dest[1] = 0x80 | (code_point & 0x3F);
+        return 2;
+    }
+    if(code_point < 0x10000) {
+        dest[0] = 0xE0 | (code_point >> 12);
+        dest[1] = 0x80 | ((code_point >> 6) & 0x3F);
+        dest[2] = 0x80 | (code_point & 0x3F);
+        return 3;
+    }
+    dest[0] = 0xF0 | (code_point >> 18);
+    dest[1] = 0x80 | ((code_point >> 12) & 0x3F);
+    dest[2] = 0x80 | ((code_point >> 6) & 0x3F);
+    dest[3] = 0x80 | (code_point & 0x3F);
+    return 4;
+}
+
+// dest needs room for 2 * count bytes
+usize latin1_to_utf8(u8* dest, u8* src, usize count) {
+    usize written = 0;
+    usize i = 0;
+    while(i + 16 <= count) {
+        __m128i chunk = _mm_loadu_si128((__m128i*)(src + i));
+        if(_mm_movemask_epi8(chunk) == 0) {
+            _mm_storeu_si128((__m128i*)(dest + written), chunk);
+            written += 16;
+            i += 16;
+            continue;
+        }
+        for(usize end = i + 16; i < end; i++) {
+            written += utf8_encode(dest + written, src[i]);
+        }
+    }
+    for(; i < count; i++) {
+        written += utf8_encode(dest + written, src[i]);
+    }
+    return written;
+}
+
+// Code points that don't fit into Latin-1 become '?'. dest needs room for
+// count bytes.
+usize utf8_to_latin1(u8* dest, u8* src, usize count) {
+    usize written = 0;
+    usize i = 0;
+    while(i < count) {
+        if(count - i >= 16) {
+            __m128i chunk = _mm_loadu_si128((__m128i*)(src + i));
+            if(_mm_movemask_epi8(chunk) == 0) {
+                _mm_storeu_si128((__m128i*)(dest + written), chunk);
+                written += 16;
+                i += 16;
+                continue;
+            }
+        }
+
+        u32 code_point;
+        usize length = utf8_decode(src + i, count - i, &code_point);
+        if(!length) {
+            length = 1;
+            code_point = '?';
+        }
+        dest[written++] = code_point <= 0xFF ? code_point : '?';
+        i += length;
+    }
+    return written;
+}
+
+inline __m128i swap_bytes_16(__m128i value) {
+    return _mm_or_si128(_mm_slli_epi16(value, 8), _mm_srli_epi16(value, 8));
+}
+
+// Converts as many UTF-16 code units as possible. A high surrogate at the
+// very end is left for the next call, *consumed tells how many bytes of src
+// were used up. Unpaired surrogates become U+FFFD. dest needs room for
+// 3 * count / 2 bytes.
+usize utf16_to_utf8(u8* dest, u8* src, usize count, int big_endian, usize* consumed) {
+    usize written = 0;
+    usize unit_count = count / 2;
+    usize i = 0;
+
+    while(i < unit_count) {
+        if(unit_count - i >= 8) {
+            __m128i chunk = _mm_loadu_si128((__m128i*)(src + i * 2));
+            if(big_endian) chunk = swap_bytes_16(chunk);
+            __m128i non_ascii = _mm_and_si128(chunk, _mm_set1_epi16((short)0xFF80));
+            if(_mm_movemask_epi8(_mm_cmpeq_epi16(non_ascii, _mm_setzero_si128())) == 0xFFFF) {
+                _mm_storel_epi64((__m128i*)(dest + written), _mm_packus_epi16(chunk, chunk));
+                written += 8;
+                i += 8;
+                continue;
+            }
+        }
+
+        u8* at = src + i * 2;
+        u32 unit = big_endian ? (at[0] << 8) | at[1] : at[0] | (at[1] << 8);
+        u32 code_point = unit;
+        usize units = 1;
+        if(unit >= 0xD800 && unit <= 0xDBFF) {
+            if(i + 1 == unit_count) break;
+            u32 next = big_endian ? (at[2] << 8) | at[3] : at[2] | (at[3] << 8);
+            if(next >= 0xDC00 && next <= 0xDFFF) {
+                code_point = 0x10000 + ((unit - 0xD800) << 10) + (next - 0xDC00);
+                units = 2;
+            } else {
+                code_point = 0xFFFD;
+            }
+        } else if(unit >= 0xDC00 && unit <= 0xDFFF) {
+            code_point = 0xFFFD;
+        }
+        written += utf8_encode(dest + written, code_point);
+        i += units;
+    }
+
+    *consumed = i * 2;
+    return written;
+}
+
+// Malformed UTF-8 becomes U+FFFD. dest needs room for 2 * count bytes.
+usize utf8_to_utf16(u8* dest, u8* src, usize count, int big_endian) {
+    usize written = 0;
+    usize i = 0;
+    while(i < count) {
+        if(count - i >= 16) {
+            __m128i chunk = _mm_loadu_si128((__m128i*)(src + i));
+            if(_mm_movemask_epi8(chunk) == 0) {
+                __m128i low = _mm_unpacklo_epi8(chunk, _mm_setzero_si128());
+                __m128i high = _mm_unpackhi_epi8(chunk, _mm_setzero_si128());
+                if(big_endian) {
+                    low = swap_bytes_16(low);
+                    high = swap_bytes_16(high);
+                }
+                _mm_storeu_si128((__m128i*)(dest + written), low);
+                _mm_storeu_si128((__m128i*)(dest + written + 16), high);
+                written += 32;
+                i += 16;
+                continue;
+            }
+        }
+
+        u32 code_point;
+        usize length = utf8_decode(src + i, count - i, &code_point);
+        if(!length) {
+            length = 1;
+            code_point = 0xFFFD;
+        }
+        i += length;
+
+        u32 units[2] = {code_point, 0};
+        usize unit_count = 1;
+        if(code_point >= 0x10000) {
+            code_point -= 0x10000;
+            units[0] = 0xD800 + (code_point >> 10);
+            units[1] = 0xDC00 + (code_point & 0x3FF);
+            unit_count = 2;
+        }
+        for(usize unit = 0; unit < unit_count; unit++) {
+            u8 low = units[unit] & 0xFF;
+            u8 high = units[unit] >> 8;
+            dest[written++] = big_endian ? high : low;
+            dest[written++] = big_endian ? low : high;
+        }
+    }
+    return written;
+}
+
+// Returns the raw bytes unchanged if they're already in the internal format,
+// so the common case stays zero-copy. Anything else gets transcoded onto the
+// arena.
+u8_array transcode_to_internal(u8_array raw, Text_Format format, Arena* arena) {
+    u8_array source = raw;
+    if(format.has_bom) {
+        usize bom_size = format.encoding == TEXT_ENCODING_UTF8 ? 3 : 2;
+        source.base += bom_size;
+        source.count -= bom_size;
+    }
+    if(format.encoding == TEXT_ENCODING_UTF8 && !format.crlf) return source;
+
+    usize capacity = source.count;
+    if(format.encoding == TEXT_ENCODING_LATIN1) capacity = source.count * 2;
+    if(format.encoding == TEXT_ENCODING_UTF16LE || format.encoding == TEXT_ENCODING_UTF16BE) {
+        capacity = source.count / 2 * 3;
+    }
+    // Worst case size. Pages we don't end up writing to never get touched,
+    // and what's left over is given back to the arena at the end.
+    u8_array result = {};
+    result.base = arena_push(arena, capacity + 1, 1);
+
+    int pending_cr = 0;
+    usize read = 0;
+    while(read < source.count) {
+        usize chunk_size = std::min(source.count - read, (usize)TRANSCODE_CHUNK_SIZE);
+        u8* src = source.base + read;
+        u8* dest = result.base + result.count;
+        // Leave room for a CR held back from the previous chunk
+        u8* decoded = dest + pending_cr;
+
+        usize written = 0;
+        usize consumed = chunk_size;
+        switch(format.encoding) {
+        case TEXT_ENCODING_UTF8: {
+            written = chunk_size;
+            decoded = src;
+        } break;
+        case TEXT_ENCODING_LATIN1: {
+            written = latin1_to_utf8(decoded, src, chunk_size);
+        } break;
+        case TEXT_ENCODING_UTF16LE:
+        case TEXT_ENCODING_UTF16BE: {
+            int big_endian = format.encoding == TEXT_ENCODING_UTF16BE;
+            written = utf16_to_utf8(decoded, src, chunk_size, big_endian, &consumed);
+            if(!consumed) {
+                // Dangling high surrogate or an odd byte at the very end
+                written = utf8_encode(decoded, 0xFFFD);
+                consumed = chunk_size;
+            }
+        } break;
+        }
+
+        // Decoded bytes are still in cache, so stripping CRs right away is
+        // cheap and doesn't need another buffer
+        if(format.crlf) written = crlf_to_lf(dest, decoded, written, &pending_cr);
+        result.count += written;
+        read += consumed;
+    }
+    if(pending_cr) result.base[result.count++] = '\r';
+
+    arena->used = result.base + result.count - arena->base;
+    return result;
+}
+
+int platform_write_all(int fd, u8* base, usize count) {
+    while(count) {
+        ssize_t written = write(fd, base, count);
+        if(written < 0) return 0;
+        base += written;
+        count -= written;
+    }
+    return 1;
+}
+
+int write_text_bom(int fd, Text_Format format) {
+    if(!format.has_bom) return 1;
+
+    u8 utf8_bom[] = {0xEF, 0xBB, 0xBF};
+    u8 utf16le_bom[] = {0xFF, 0xFE};
+    u8 utf16be_bom[] = {0xFE, 0xFF};
+    switch(format.encoding) {
+    case TEXT_ENCODING_UTF8: return platform_write_all(fd, utf8_bom, 3);
+    case TEXT_ENCODING_UTF16LE: return platform_write_all(fd, utf16le_bom, 2);
+    case TEXT_ENCODING_UTF16BE: return platform_write_all(fd, utf16be_bom, 2);
+    case TEXT_ENCODING_LATIN1: break;
+    }
+    return 1;
+}
+
+// Writes internal UTF-8/LF text to fd converting it back into the file's
+// format chunk by chunk. The BOM is written separately by write_text_bom.
+int write_text_transcoded(int fd, u8_array text, Text_Format format) {
+    // Enough for CRLF doubling and then UTF-16 doubling
+    static u8 crlf_buffer[TRANSCODE_CHUNK_SIZE * 2];
+    static u8 encoded_buffer[TRANSCODE_CHUNK_SIZE * 4];
+
+    usize read = 0;
+    while(read < text.count) {
+        usize chunk_size = std::min(text.count - read, (usize)TRANSCODE_CHUNK_SIZE);
+        // Don't cut a sequence in half
+        if(read + chunk_size < text.count) {
+            usize cut = chunk_size;
+            while(cut > chunk_size - 3 && (text.base[read + cut] & 0xC0) == 0x80) cut--;
+            chunk_size = cut;
+        }
+
+        u8_array chunk = {text.base + read, chunk_size};
+        if(format.crlf) {
+            chunk.count = lf_to_crlf(crlf_buffer, chunk.base, chunk.count);
+            chunk.base = crlf_buffer;
+        }
+
+        switch(format.encoding) {
+        case TEXT_ENCODING_UTF8: break;
+        case TEXT_ENCODING_LATIN1: {
+            chunk.count = utf8_to_latin1(encoded_buffer, chunk.base, chunk.count);
+            chunk.base = encoded_buffer;
+        } break;
+        case TEXT_ENCODING_UTF16LE:
+        case TEXT_ENCODING_UTF16BE: {
+            int big_endian = format.encoding == TEXT_ENCODING_UTF16BE;
+            chunk.count = utf8_to_utf16(encoded_buffer, chunk.base, chunk.count, big_endian);
+            chunk.base = encoded_buffer;
+        } break;
+        }
+
+        if(!platform_write_all(fd, chunk.base, chunk.count)) return 0;
+        read += chunk_size;
+    }
+    return 1;
+}
+
+// Line index for (possibly huge) read-only text.
+//
+// Instead of scanning the whole file upfront, we split it into fixed size
+// chunks and lazily count newlines per chunk, whenever somebody scrolls or
+// jumps there. The contiguous prefix of counted chunks gets cumulative line
+// numbers (checkpoints), so a line query only scans from the nearest
+// checkpoint. A background thread keeps extending that prefix until the
+// whole file is indexed.
+#define LINE_INDEX_CHUNK_SIZE (64 * 1024)
+#define LINE_INDEX_UNKNOWN_COUNT UINT32_MAX
+// Files smaller than that are indexed completely right at open,
+// it takes a few milliseconds anyway
+#define LINE_INDEX_EAGER_LIMIT (64 * 1024 * 1024)
+// How many chunks a query is allowed to count on the caller's thread before
+// giving up and letting the background thread catch up
+#define LINE_INDEX_MAX_SYNC_CHUNKS 256
+#define LINE_INDEX_BACKGROUND_BATCH 16
+
+struct Line_Index {
+    // Both only change under the mutex, when the file is appended to
+    u8_array text;
+    usize chunk_size;
+    usize chunk_count;
+    // The most chunks the arrays below have address space for
+    usize chunk_capacity;
+    // Newline count of each chunk or LINE_INDEX_UNKNOWN_COUNT if not counted yet
+    Arena counts_arena;
+    u32* chunk_line_counts;
+    // checkpoints[i] is the number of the line containing byte i * chunk_size,
+    // only valid for i <= known_chunk_count.
+    Arena checkpoints_arena;
+    usize* checkpoints;
+    // Accessed atomically. Extended under the mutex, and only goes back
+    // when appending to the text makes the last chunk's count stale.
+    usize known_chunk_count;
+    pthread_mutex_t mutex;
+    pthread_t thread;
+    // Accessed atomically, cleared by the thread when it's done
+    int background_running;
+    int has_thread;
+    // Accessed atomically, set when the index is going away
+    int stopping;
+};
+
+u32 line_index_count_chunk(Line_Index* index, usize chunk) {
+    u32 result = __atomic_load_n(&index->chunk_line_counts[chunk], __ATOMIC_RELAXED);
+    if(result == LINE_INDEX_UNKNOWN_COUNT) {
+        usize start = chunk * index->chunk_size;
+        usize count = std::min(index->chunk_size, index->text.count - start);
+        result = count_newlines(index->text.base + start, count);
+        // Two threads may race to count the same chunk, but they'll store the
+        // same number so it doesn't matter who wins.
+        __atomic_store_n(&index->chunk_line_counts[chunk], result, __ATOMIC_RELAXED);
+    }
+    return result;
+}
+
+void line_index_extend(Line_Index* index, usize target_known_chunk_count) {
+    pthread_mutex_lock(&index->mutex);
+    target_known_chunk_count = std::min(target_known_chunk_count, index->chunk_count);
+    usize known = index->known_chunk_count;
+    while(known < target_known_chunk_count) {
+        index->checkpoints[known + 1] = index->checkpoints[known] +
+            line_index_count_chunk(index, known);
+        known++;
+        __atomic_store_n(&index->known_chunk_count, known, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&index->mutex);
+}
+
+// Records the counts of chunks overlapping [start, end) without requiring
+// everything before them to be counted. This is what leaves checkpoints
+// behind as the user scrolls or jumps around the file.
+void line_index_touch(Line_Index* index, usize start, usize end) {
+    if(!index->chunk_count) return;
+
+    end = std::min(end, index->text.count);
+    usize last_chunk = std::min(end / index->chunk_size, index->chunk_count - 1);
+    for(usize chunk = start / index->chunk_size; chunk <= last_chunk; chunk++) {
+        line_index_count_chunk(index, chunk);
+    }
+}
+
+// Returns 0 if the line number can't be figured out cheaply right now
+// (the background thread hasn't reached that part of the file yet).
+int line_index_line_from_offset(Line_Index* index, usize offset, usize* line) {
+    offset = std::min(offset, index->text.count);
+    usize chunk = std::min(offset / index->chunk_size, index->chunk_count);
+
+    usize known = __atomic_load_n(&index->known_chunk_count, __ATOMIC_ACQUIRE);
+    if(chunk > known) {
+        if(chunk - known > LINE_INDEX_MAX_SYNC_CHUNKS) return 0;
+        line_index_extend(index, chunk);
+    }
+
+    usize chunk_start = chunk * index->chunk_size;
+    *line = index->checkpoints[chunk] +
+        count_newlines(index->text.base + chunk_start, offset - chunk_start);
+    return 1;
+}
+
+// Finds the byte offset where a given line starts. Returns 0 if the line is
+// past the end of the file or too far ahead of what we've indexed so far,
+// in which case it's worth retrying after the background thread progresses.
+int line_index_offset_from_line(Line_Index* index, usize line, usize* offset) {
+    if(line == 0) {
+        *offset = 0;
+        return 1;
+    }
+
+    usize known = __atomic_load_n(&index->known_chunk_count, __ATOMIC_ACQUIRE);
+    usize synced_chunks = 0;
+    // We need the line-th newline, so look for a checkpoint that has it
+    // somewhere after
+    while(index->checkpoints[known] < line) {
+        if(known == index->chunk_count) return 0;
+        if(synced_chunks >= LINE_INDEX_MAX_SYNC_CHUNKS) return 0;
+
+        line_index_extend(index, known + LINE_INDEX_BACKGROUND_BATCH);
+        synced_chunks += LINE_INDEX_BACKGROUND_BATCH;
+        known = __atomic_load_n(&index->known_chunk_count, __ATOMIC_ACQUIRE);
+    }
+
+    // The last checkpoint before the line-th newline
+    usize low = 0;
+    usize high = known;
+    while(high - low > 1) {
+        usize middle = low + (high - low) / 2;
+        if(index->checkpoints[middle] < line) low = middle;
+        else high = middle;
+    }
+
+    usize newlines_left = line - index->checkpoints[low];
+    u8* at = index->text.base + low * index->chunk_size;
+    u8* end = index->text.base + index->text.count;
+    while(newlines_left) {
+        at = (u8*)memchr(at, '\n', end - at);
+        // The text changed under the counts, a mapped file rewritten in
+        // place. Nothing to answer until the reload replaces the index.
+        if(!at) return 0;
+        at++;
+        newlines_left--;
+    }
+
+    *offset = at - index->text.base;
+    return 1;
+}
+
+void* line_index_background_proc(void* data) {
+    auto index = (Line_Index*)data;
+    auto scope = begin_fault_scope(FAULT_INDEX);
+
+    // One pass from start to end, let the kernel read ahead as far as it
+    // likes and drop what we're done with
+    platform_advise(index->text.base, index->text.count, ACCESS_SEQUENTIAL);
+    u8_array text;
+    while(1) {
+        usize known = __atomic_load_n(&index->known_chunk_count, __ATOMIC_ACQUIRE);
+        line_index_extend(index, known + LINE_INDEX_BACKGROUND_BATCH);
+
+        // Checked under the mutex, so line_index_append either sees us still
+        // running or we see what it appended
+        pthread_mutex_lock(&index->mutex);
+        int done = index->known_chunk_count == index->chunk_count ||
+            __atomic_load_n(&index->stopping, __ATOMIC_ACQUIRE);
+        text = index->text;
+        if(done) __atomic_store_n(&index->background_running, 0, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&index->mutex);
+        if(done) break;
+    }
+
+    // From now on it's jumps and scrolling around, readahead of a huge file
+    // would mostly pull in pages nobody looks at. The views ask for what
+    // they're about to show explicitly.
+    platform_advise(text.base, text.count, ACCESS_RANDOM);
+    end_fault_scope(scope);
+    return 0;
+}
+
+// Counts what's left right away if that's cheap, otherwise on a thread
+void line_index_catch_up(Line_Index* index) {
+    if(__atomic_load_n(&index->background_running, __ATOMIC_ACQUIRE)) return;
+
+    usize known = __atomic_load_n(&index->known_chunk_count, __ATOMIC_ACQUIRE);
+    if(index->chunk_count - known <= LINE_INDEX_EAGER_LIMIT / LINE_INDEX_CHUNK_SIZE) {
+        line_index_extend(index, index->chunk_count);
+        return;
+    }
+
+    if(index->has_thread) pthread_join(index->thread, 0);
+    index->background_running = 1;
+    int err = pthread_create(&index->thread, 0, line_index_background_proc, index);
+    assert(!err, "Couldn't start the line indexing thread");
+    index->has_thread = 1;
+}
+
+// capacity is how long the text can get through line_index_append. The
+// arrays only reserve address space for it, so it's fine to be generous.
+Line_Index* make_line_index(Arena* arena, u8_array text, usize capacity) {
+    auto index = arena_push_struct(arena, Line_Index);
+    *index = {};
+    index->text = text;
+    index->chunk_size = LINE_INDEX_CHUNK_SIZE;
+    index->chunk_count = (text.count + index->chunk_size - 1) / index->chunk_size;
+    capacity = std::max(capacity, text.count);
+    index->chunk_capacity = (capacity + index->chunk_size - 1) / index->chunk_size;
+
+    // Arenas of their own so they can grow with the text, and so their
+    // memory shows up as line index rather than text
+    index->counts_arena = make_arena(index->chunk_capacity * sizeof(u32), MEMORY_LINE_INDEX);
+    index->chunk_line_counts = (u32*)arena_grow_to(&index->counts_arena,
+                                                   index->chunk_count * sizeof(u32));
+    index->checkpoints_arena = make_arena((index->chunk_capacity + 1) * sizeof(usize),
+                                          MEMORY_LINE_INDEX);
+    index->checkpoints = (usize*)arena_grow_to(&index->checkpoints_arena,
+                                               (index->chunk_count + 1) * sizeof(usize));
+    memset(index->chunk_line_counts, 0xFF, index->chunk_count * sizeof(u32));
+    index->checkpoints[0] = 0;
+    pthread_mutex_init(&index->mutex, 0);
+
+    line_index_catch_up(index);
+    return index;
+}
+
+// Stops the background thread, nothing may touch the index after this
+void free_line_index(Line_Index* index) {
+    __atomic_store_n(&index->stopping, 1, __ATOMIC_RELEASE);
+    if(index->has_thread) pthread_join(index->thread, 0);
+    free_arena(&index->counts_arena);
+    free_arena(&index->checkpoints_arena);
+    pthread_mutex_destroy(&index->mutex);
+}
+
+// The text got longer at the end, e.g. a log file we're following. Only the
+// new chunks and the one that used to be last need counting.
+void line_index_append(Line_Index* index, u8_array text) {
+    assert(text.base == index->text.base && text.count >= index->text.count,
+           "Line index can only be appended to");
+
+    pthread_mutex_lock(&index->mutex);
+    usize chunk_count = (text.count + index->chunk_size - 1) / index->chunk_size;
+    assert(chunk_count <= index->chunk_capacity, "Line index is out of capacity");
+    // Never moves, so the background thread can keep going meanwhile
+    arena_grow_to(&index->counts_arena, chunk_count * sizeof(u32));
+    arena_grow_to(&index->checkpoints_arena, (chunk_count + 1) * sizeof(usize));
+
+    usize last_chunk = index->chunk_count - 1;
+    if(index->chunk_count && index->text.count % index->chunk_size) {
+        // It was partial, so its count is about less text than it has now
+        __atomic_store_n(&index->chunk_line_counts[last_chunk], LINE_INDEX_UNKNOWN_COUNT,
+                         __ATOMIC_RELAXED);
+        if(index->known_chunk_count > last_chunk) {
+            __atomic_store_n(&index->known_chunk_count, last_chunk, __ATOMIC_RELEASE);
+        }
+    }
+    memset(index->chunk_line_counts + index->chunk_count, 0xFF,
+           (chunk_count - index->chunk_count) * sizeof(u32));
+    index->text = text;
+    __atomic_store_n(&index->chunk_count, chunk_count, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&index->mutex);
+
+    line_index_catch_up(index);
+}
+
+// Text buffer
+//
+// A piece table: the text is a sequence of pieces, each referencing either
+// the original text (usually a mapping of the file) or the append-only added
+// buffer. Neither of them ever changes or moves, edits only touch the piece
+// array. That's also what makes saving cheap: unchanged spans are still
+// literally the original file.
+enum Piece_Source {
+    PIECE_ORIGINAL,
+    PIECE_ADDED,
+};
+
+struct Piece {
+    Piece_Source source;
+    usize start;
+    usize count;
+};
+
+// Virtual address space for the added text, only what's used gets committed
+#define TEXT_BUFFER_ADDED_RESERVE (4ull * 1024 * 1024 * 1024)
+#define TEXT_BUFFER_PIECE_RESERVE (1ull * 1024 * 1024 * 1024)
+
+enum Edit_Kind {
+    EDIT_INSERT,
+    EDIT_DELETE,
+};
+
+struct Edit {
+    Edit_Kind kind;
+    usize offset;
+    usize count;
+    // What was inserted or deleted, a range of Text_Buffer::undo_pieces
+    usize first_piece;
+    usize piece_count;
+    // Edits with the same group are undone together
+    u64 group;
+};
+
+#define TEXT_BUFFER_MAX_MARKS 16
+// How much of the end of the file we check is still there before taking
+// growth for an append
+#define FOLLOW_CHECK_SIZE 4096
+
+struct Text_Buffer {
+    cstring path;
+    // What the file looked like on disk, text is always UTF-8 with LF
+    Text_Format format;
+
+    u8_array original;
+    Line_Index* line_index;
+    // -1 if the original text is not a verbatim slice of the file (it had to
+    // be transcoded), otherwise we can copy spans of it straight from the fd
+    int original_fd;
+    usize original_file_offset;
+    // How far the original text can grow in place when the file is appended
+    // to, 0 if it can't. Copies grow by reading, mappings by mapping more.
+    usize original_capacity;
+    int original_is_copy;
+
+    // The file at the path, as far as we have it. As long as that's the
+    // file behind original_fd, the original text grows in place. Once it
+    // got replaced or rewritten, original_fd only stays around for saving,
+    // and whatever the new file grows by is read into added. -1 when the
+    // text is transcoded, then there's nothing to follow.
+    int follow_fd;
+    usize follow_file_count;
+    // Hash of the last FOLLOW_CHECK_SIZE bytes of it that we have
+    u64 follow_check_hash;
+    // Its modification time when it was follow_file_count long. Written
+    // to without growing means rewritten.
+    struct timespec follow_modified;
+
+    // Typed text, only ever appended to
+    Arena added_arena;
+    u8* added;
+
+    // Pieces and the undo arrays each get an arena of their own, so they can
+    // grow without being copied
+    Arena piece_arena;
+    Piece* pieces;
+    usize piece_count;
+
+    usize count;
+    // Bumped on every edit, the buffer is modified if it's not what we saved
+    u64 edit_count;
+    u64 saved_edit_count;
+
+    // Undo history. Entries below undo_count are undoable, the ones from
+    // there to undo_total redoable. Pieces removed by deletions live in
+    // undo_pieces, so undo never has to copy text.
+    Arena undo_arena;
+    Edit* undo_log;
+    usize undo_count;
+    usize undo_total;
+    Arena undo_piece_arena;
+    Piece* undo_pieces;
+    usize undo_piece_count;
+    u64 undo_group;
+
+    // Offsets owned by someone else (cursors, marks) that have to move with
+    // the text around them
+    usize* marks[TEXT_BUFFER_MAX_MARKS];
+    usize mark_count;
+
+    // Everything else that lives as long as the buffer: the buffer itself,
+    // transcoded text, the line index
+    Arena arena;
+};
+
+Text_Buffer* make_text_buffer(cstring path, Mapped_File file) {
+    Arena arena = make_arena(ARENA_DEFAULT_RESERVE, MEMORY_TEXT);
+    auto buffer = arena_push_struct(&arena, Text_Buffer);
+    *buffer = {};
+    buffer->arena = arena;
+    buffer->path = path;
+    buffer->format = detect_text_format(file.data);
+    if(!text_format_is_internal(buffer->format)) {
+        platform_advise(file.data.base, file.data.count, ACCESS_SEQUENTIAL);
+    }
+    buffer->original = transcode_to_internal(file.data, buffer->format, &buffer->arena);
+    buffer->original_fd = -1;
+    buffer->follow_fd = -1;
+    if(buffer->format.encoding == TEXT_ENCODING_UTF8 && !buffer->format.crlf) {
+        buffer->original_fd = file.fd;
+        buffer->follow_fd = file.fd;
+        buffer->follow_file_count = file.data.count;
+        struct stat statbuf;
+        if(fstat(file.fd, &statbuf) == 0) buffer->follow_modified = statbuf.st_mtim;
+        buffer->original_file_offset = buffer->original.base - file.data.base;
+        buffer->original_is_copy = file.is_copy;
+        // Only verbatim text can be followed, transcoded text would need
+        // transcoding the appended part and there's no point for logs
+        if(file.capacity > file.data.count) {
+            buffer->original_capacity = file.capacity - buffer->original_file_offset;
+        }
+        usize check_count = std::min(file.data.count, (usize)FOLLOW_CHECK_SIZE);
+        buffer->follow_check_hash = hash_bytes(file.data.base + file.data.count - check_count,
+                                               check_count);
+    }
+    // For huge files this only allocates the index, the actual counting
+    // happens lazily and on a background thread, so we can show the first
+    // screen right away
+    buffer->line_index = make_line_index(&buffer->arena, buffer->original,
+                                         buffer->original_capacity);
+
+    buffer->added_arena = make_arena(TEXT_BUFFER_ADDED_RESERVE, MEMORY_ADDED_TEXT);
+    buffer->added = buffer->added_arena.base;
+    buffer->piece_arena = make_arena(TEXT_BUFFER_PIECE_RESERVE, MEMORY_PIECES);
+    buffer->pieces = (Piece*)arena_grow_to(&buffer->piece_arena, sizeof(Piece));
+    buffer->undo_arena = make_arena(TEXT_BUFFER_PIECE_RESERVE, MEMORY_UNDO);
+    buffer->undo_log = (Edit*)buffer->undo_arena.base;
+    buffer->undo_piece_arena = make_arena(TEXT_BUFFER_PIECE_RESERVE, MEMORY_UNDO);
+    buffer->undo_pieces = (Piece*)buffer->undo_piece_arena.base;
+    if(buffer->original.count) {
+        buffer->pieces[0] = {PIECE_ORIGINAL, 0, buffer->original.count};
+        buffer->piece_count = 1;
+    }
+    buffer->count = buffer->original.count;
+    return buffer;
+}
+
+int buffer_is_modified(Text_Buffer* buffer) {
+    return buffer->edit_count != buffer->saved_edit_count;
+}
+
+u8* piece_base(Text_Buffer* buffer, Piece* piece) {
+    u8* base = piece->source == PIECE_ORIGINAL ? buffer->original.base : buffer->added;
+    return base + piece->start;
+}
+
+// Index of the piece containing the offset and where in the piece it is.
+// The end of the text gives piece_count.
+usize buffer_find_piece(Text_Buffer* buffer, usize offset, usize* offset_in_piece) {
+    usize piece_start = 0;
+    for(usize i = 0; i < buffer->piece_count; i++) {
+        usize piece_end = piece_start + buffer->pieces[i].count;
+        if(offset < piece_end) {
+            *offset_in_piece = offset - piece_start;
+            return i;
+        }
+        piece_start = piece_end;
+    }
+    *offset_in_piece = 0;
+    return buffer->piece_count;
+}
+
+void buffer_insert_pieces(Text_Buffer* buffer, usize index, usize count) {
+    arena_grow_to(&buffer->piece_arena, (buffer->piece_count + count) * sizeof(Piece));
+    memmove(buffer->pieces + index + count, buffer->pieces + index,
+            (buffer->piece_count - index) * sizeof(Piece));
+    buffer->piece_count += count;
+}
+
+void buffer_remove_piece(Text_Buffer* buffer, usize index) {
+    memmove(buffer->pieces + index, buffer->pieces + index + 1,
+            (buffer->piece_count - index - 1) * sizeof(Piece));
+    buffer->piece_count--;
+}
+
+// Splits so that a piece starts exactly at the offset, returns its index
+usize buffer_split_at(Text_Buffer* buffer, usize offset) {
+    usize offset_in_piece;
+    usize index = buffer_find_piece(buffer, offset, &offset_in_piece);
+    if(offset_in_piece == 0) return index;
+
+    buffer_insert_pieces(buffer, index + 1, 1);
+    Piece* left = &buffer->pieces[index];
+    Piece* right = &buffer->pieces[index + 1];
+    *right = *left;
+    left->count = offset_in_piece;
+    right->start += offset_in_piece;
+    right->count -= offset_in_piece;
+    return index + 1;
+}
+
+// Registers an offset to be kept pointing at the same text across edits.
+// Text inserted right at a mark goes after it.
+void buffer_add_mark(Text_Buffer* buffer, usize* offset) {
+    assert(buffer->mark_count < TEXT_BUFFER_MAX_MARKS, "Too many marks in a buffer");
+    buffer->marks[buffer->mark_count++] = offset;
+}
+
+void buffer_remove_mark(Text_Buffer* buffer, usize* offset) {
+    for(usize i = 0; i < buffer->mark_count; i++) {
+        if(buffer->marks[i] != offset) continue;
+        buffer->marks[i] = buffer->marks[--buffer->mark_count];
+        return;
+    }
+}
+
+// Everything that changes the text goes through these two, undo included
+void buffer_insert_span(Text_Buffer* buffer, usize offset, Piece* pieces, usize piece_count) {
+    usize count = 0;
+    for(usize i = 0; i < piece_count; i++) count += pieces[i].count;
+    if(!count) return;
+
+    usize index = buffer_split_at(buffer, offset);
+    Piece* previous = index > 0 ? &buffer->pieces[index - 1] : 0;
+    if(piece_count == 1 && previous && previous->source == pieces[0].source &&
+       previous->start + previous->count == pieces[0].start) {
+        // Typing just keeps growing the same piece
+        previous->count += count;
+    } else {
+        buffer_insert_pieces(buffer, index, piece_count);
+        memcpy(buffer->pieces + index, pieces, piece_count * sizeof(Piece));
+    }
+
+    for(usize i = 0; i < buffer->mark_count; i++) {
+        if(*buffer->marks[i] > offset) *buffer->marks[i] += count;
+    }
+    buffer->count += count;
+    buffer->edit_count++;
+}
+
+// If removed isn't null, the pieces that were removed get appended to it
+void buffer_remove_span(Text_Buffer* buffer, usize offset, usize count, Edit* removed) {
+    usize index = buffer_split_at(buffer, offset);
+    usize end_index = buffer_split_at(buffer, offset + count);
+    usize piece_count = end_index - index;
+    if(removed) {
+        arena_grow_to(&buffer->undo_piece_arena,
+                      (buffer->undo_piece_count + piece_count) * sizeof(Piece));
+        memcpy(buffer->undo_pieces + buffer->undo_piece_count, buffer->pieces + index,
+               piece_count * sizeof(Piece));
+        removed->first_piece = buffer->undo_piece_count;
+        removed->piece_count = piece_count;
+        buffer->undo_piece_count += piece_count;
+    }
+    memmove(buffer->pieces + index, buffer->pieces + end_index,
+            (buffer->piece_count - end_index) * sizeof(Piece));
+    buffer->piece_count -= piece_count;
+
+    for(usize i = 0; i < buffer->mark_count; i++) {
+        usize* mark = buffer->marks[i];
+        if(*mark > offset + count) *mark -= count;
+        else if(*mark > offset) *mark = offset;
+    }
+    buffer->count -= count;
+    buffer->edit_count++;
+}
+
+// Edits made until the next call are undone in one go
+void buffer_begin_undo_group(Text_Buffer* buffer) {
+    buffer->undo_group++;
+}
+
+Edit* buffer_log_edit(Text_Buffer* buffer, Edit_Kind kind, usize offset, usize count) {
+    // A new edit makes whatever was undone unreachable
+    if(buffer->undo_count < buffer->undo_total) {
+        buffer->undo_piece_count = buffer->undo_log[buffer->undo_count].first_piece;
+        buffer->undo_total = buffer->undo_count;
+    }
+    arena_grow_to(&buffer->undo_arena, (buffer->undo_total + 1) * sizeof(Edit));
+    Edit* edit = &buffer->undo_log[buffer->undo_total++];
+    buffer->undo_count = buffer->undo_total;
+    *edit = {kind, offset, count, buffer->undo_piece_count, 0, buffer->undo_group};
+    return edit;
+}
+
+void buffer_insert(Text_Buffer* buffer, usize offset, String text) {
+    assert(offset <= buffer->count);
+    if(!text.count) return;
+    u8* added = arena_push(&buffer->added_arena, text.count, 1);
+    memcpy(added, text.base, text.count);
+    Piece piece = {PIECE_ADDED, (usize)(added - buffer->added), text.count};
+
+    // Typing extends the previous insert instead of logging every letter
+    Edit* last = buffer->undo_count ? &buffer->undo_log[buffer->undo_count - 1] : 0;
+    if(last && buffer->undo_count == buffer->undo_total && last->group == buffer->undo_group &&
+       last->kind == EDIT_INSERT && last->offset + last->count == offset &&
+       last->first_piece + last->piece_count == buffer->undo_piece_count) {
+        Piece* last_piece = &buffer->undo_pieces[buffer->undo_piece_count - 1];
+        if(last_piece->source == PIECE_ADDED && last_piece->start + last_piece->count == piece.start) {
+            last_piece->count += text.count;
+            last->count += text.count;
+            buffer_insert_span(buffer, offset, &piece, 1);
+            return;
+        }
+    }
+
+    Edit* edit = buffer_log_edit(buffer, EDIT_INSERT, offset, text.count);
+    // Inserted pieces get logged too, so redo can put them back
+    arena_grow_to(&buffer->undo_piece_arena, (buffer->undo_piece_count + 1) * sizeof(Piece));
+    buffer->undo_pieces[buffer->undo_piece_count++] = piece;
+    edit->piece_count = 1;
+    buffer_insert_span(buffer, offset, &piece, 1);
+}
+
+void buffer_delete(Text_Buffer* buffer, usize offset, usize count) {
+    count = std::min(count, buffer->count - offset);
+    if(!count) return;
+    Edit* edit = buffer_log_edit(buffer, EDIT_DELETE, offset, count);
+    buffer_remove_span(buffer, offset, count, edit);
+}
+
+// Both return 0 if there's nothing to do, otherwise where the cursor goes
+int buffer_undo(Text_Buffer* buffer, usize* cursor) {
+    if(!buffer->undo_count) return 0;
+    u64 group = buffer->undo_log[buffer->undo_count - 1].group;
+    while(buffer->undo_count && buffer->undo_log[buffer->undo_count - 1].group == group) {
+        Edit* edit = &buffer->undo_log[--buffer->undo_count];
+        if(edit->kind == EDIT_INSERT) {
+            buffer_remove_span(buffer, edit->offset, edit->count, 0);
+            *cursor = edit->offset;
+        } else {
+            buffer_insert_span(buffer, edit->offset, buffer->undo_pieces + edit->first_piece,
+                               edit->piece_count);
+            *cursor = edit->offset + edit->count;
+        }
+    }
+    // Don't let typing after this extend what came before the undo
+    buffer_begin_undo_group(buffer);
+    return 1;
+}
+
+int buffer_redo(Text_Buffer* buffer, usize* cursor) {
+    if(buffer->undo_count == buffer->undo_total) return 0;
+    u64 group = buffer->undo_log[buffer->undo_count].group;
+    while(buffer->undo_count < buffer->undo_total &&
+          buffer->undo_log[buffer->undo_count].group == group) {
+        Edit* edit = &buffer->undo_log[buffer->undo_count++];
+        if(edit->kind == EDIT_INSERT) {
+            buffer_insert_span(buffer, edit->offset, buffer->undo_pieces + edit->first_piece,
+                               edit->piece_count);
+            *cursor = edit->offset + edit->count;
+        } else {
+            buffer_remove_span(buffer, edit->offset, edit->count, 0);
+            *cursor = edit->offset;
+        }
+    }
+    buffer_begin_undo_group(buffer);
+    return 1;
+}
+
+// Asks the kernel to start reading what's about to be shown. After indexing
+// the mapping has no readahead, so this is the only readahead there is.
+void buffer_prefetch(Text_Buffer* buffer, usize offset, usize count) {
+    usize offset_in_piece;
+    usize index = buffer_find_piece(buffer, offset, &offset_in_piece);
+    usize done = 0;
+    for(; index < buffer->piece_count && done < count; index++) {
+        Piece* piece = &buffer->pieces[index];
+        usize chunk = std::min(piece->count - offset_in_piece, count - done);
+        if(piece->source == PIECE_ORIGINAL) {
+            platform_advise(piece_base(buffer, piece) + offset_in_piece, chunk, ACCESS_WILL_NEED);
+        }
+        done += chunk;
+        offset_in_piece = 0;
+    }
+}
+
+// Copies up to count bytes starting at offset, returns how many were copied
+usize buffer_copy(Text_Buffer* buffer, usize offset, u8* dest, usize count) {
+    usize offset_in_piece;
+    usize index = buffer_find_piece(buffer, offset, &offset_in_piece);
+    usize copied = 0;
+    for(; index < buffer->piece_count && copied < count; index++) {
+        Piece* piece = &buffer->pieces[index];
+        usize chunk = std::min(piece->count - offset_in_piece, count - copied);
+        memcpy(dest + copied, piece_base(buffer, piece) + offset_in_piece, chunk);
+        copied += chunk;
+        offset_in_piece = 0;
+    }
+    return copied;
+}
+
+u8 buffer_byte(Text_Buffer* buffer, usize offset) {
+    u8 result = 0;
+    buffer_copy(buffer, offset, &result, 1);
+    return result;
+}
+
+// Position of the first byte at or after offset, or buffer->count
+usize buffer_find_forward(Text_Buffer* buffer, usize offset, u8 byte) {
+    usize offset_in_piece;
+    usize index = buffer_find_piece(buffer, offset, &offset_in_piece);
+    for(; index < buffer->piece_count; index++) {
+        Piece* piece = &buffer->pieces[index];
+        u8* base = piece_base(buffer, piece);
+        auto found = (u8*)memchr(base + offset_in_piece, byte, piece->count - offset_in_piece);
+        if(found) return offset + (found - base - offset_in_piece);
+        offset += piece->count - offset_in_piece;
+        offset_in_piece = 0;
+    }
+    return buffer->count;
+}
+
+// Position of the last byte before offset, or buffer->count if there's none
+usize buffer_find_backward(Text_Buffer* buffer, usize offset, u8 byte) {
+    usize offset_in_piece;
+    usize index = buffer_find_piece(buffer, offset, &offset_in_piece);
+    usize piece_start = offset - offset_in_piece;
+    // Start with the part of the piece before the offset
+    usize search_count = offset_in_piece;
+    if(index == buffer->piece_count || offset_in_piece == 0) {
+        if(index == 0) return buffer->count;
+        index--;
+        search_count = buffer->pieces[index].count;
+        piece_start -= search_count;
+    }
+
+    while(1) {
+        Piece* piece = &buffer->pieces[index];
+        u8* base = piece_base(buffer, piece);
+        auto found = (u8*)memrchr(base, byte, search_count);
+        if(found) return piece_start + (found - base);
+        if(index == 0) return buffer->count;
+        index--;
+        search_count = buffer->pieces[index].count;
+        piece_start -= search_count;
+    }
+}
+
+usize buffer_line_start(Text_Buffer* buffer, usize offset) {
+    usize newline = buffer_find_backward(buffer, offset, '\n');
+    return newline == buffer->count ? 0 : newline + 1;
+}
+
+// Steps within the piece the offset is in. Only when that runs into the
+// piece's edge on a continuation byte do we go byte by byte across pieces.
+usize buffer_next_code_point(Text_Buffer* buffer, usize offset) {
+    if(offset >= buffer->count) return buffer->count;
+    usize offset_in_piece;
+    Piece* piece = &buffer->pieces[buffer_find_piece(buffer, offset, &offset_in_piece)];
+    usize next = utf8_next(u8_array {piece_base(buffer, piece), piece->count}, offset_in_piece);
+    offset += next - offset_in_piece;
+    if(next < piece->count) return offset;
+    while(offset < buffer->count && (buffer_byte(buffer, offset) & 0xC0) == 0x80) offset++;
+    return offset;
+}
+
+usize buffer_previous_code_point(Text_Buffer* buffer, usize offset) {
+    if(offset == 0) return 0;
+    usize offset_in_piece;
+    Piece* piece = &buffer->pieces[buffer_find_piece(buffer, offset - 1, &offset_in_piece)];
+    u8_array text = {piece_base(buffer, piece), piece->count};
+    usize previous = utf8_previous(text, offset_in_piece + 1);
+    if(previous > 0 || (text.base[0] & 0xC0) != 0x80) {
+        return offset - (offset_in_piece + 1 - previous);
+    }
+
+    offset--;
+    for(int i = 0; i < 3 && offset > 0 && (buffer_byte(buffer, offset) & 0xC0) == 0x80; i++) {
+        offset--;
+    }
+    return offset;
+}
+
+// Code points in [start, end), piece by piece so lines of any length work.
+// Pieces can split a code point, but only lead bytes are counted anyway.
+usize buffer_count_code_points(Text_Buffer* buffer, usize start, usize end) {
+    usize offset_in_piece;
+    usize index = buffer_find_piece(buffer, start, &offset_in_piece);
+    usize result = 0;
+    for(usize at = start; index < buffer->piece_count && at < end; index++) {
+        Piece* piece = &buffer->pieces[index];
+        usize count = std::min(piece->count - offset_in_piece, end - at);
+        u8_array text = {piece_base(buffer, piece) + offset_in_piece, count};
+        result += utf8_column(text, 0, count);
+        at += count;
+        offset_in_piece = 0;
+    }
+    return result;
+}
+
+// Makes sure the line index counted whatever original text backs [start, end)
+void buffer_touch_lines(Text_Buffer* buffer, usize start, usize end) {
+    usize offset_in_piece;
+    usize index = buffer_find_piece(buffer, start, &offset_in_piece);
+    usize at = start - offset_in_piece;
+    for(; index < buffer->piece_count && at < end; index++) {
+        Piece* piece = &buffer->pieces[index];
+        if(piece->source == PIECE_ORIGINAL) {
+            usize touch_end = piece->start + std::min(piece->count, end - at);
+            line_index_touch(buffer->line_index, piece->start + offset_in_piece, touch_end);
+        }
+        at += piece->count;
+        offset_in_piece = 0;
+    }
+}
+
+// Line queries walk the pieces, original pieces are answered by the line
+// index and added ones are small enough to just count. Both return 0 if the
+// line index can't answer cheaply yet.
+int buffer_line_from_offset(Text_Buffer* buffer, usize offset, usize* line) {
+    usize result = 0;
+    usize piece_start = 0;
+    for(usize i = 0; i < buffer->piece_count && piece_start < offset; i++) {
+        Piece* piece = &buffer->pieces[i];
+        usize count = std::min(piece->count, offset - piece_start);
+        if(piece->source == PIECE_ORIGINAL) {
+            usize first, last;
+            if(!line_index_line_from_offset(buffer->line_index, piece->start, &first)) return 0;
+            if(!line_index_line_from_offset(buffer->line_index, piece->start + count, &last)) return 0;
+            result += last - first;
+        } else {
+            result += count_newlines(piece_base(buffer, piece), count);
+        }
+        piece_start += piece->count;
+    }
+    *line = result;
+    return 1;
+}
+
+int buffer_offset_from_line(Text_Buffer* buffer, usize line, usize* offset) {
+    if(line == 0) {
+        *offset = 0;
+        return 1;
+    }
+
+    usize lines_before = 0;
+    usize piece_start = 0;
+    for(usize i = 0; i < buffer->piece_count; i++) {
+        Piece* piece = &buffer->pieces[i];
+        usize newlines_needed = line - lines_before;
+        usize newlines;
+        if(piece->source == PIECE_ORIGINAL) {
+            auto index = buffer->line_index;
+            usize first;
+            if(!line_index_line_from_offset(index, piece->start, &first)) return 0;
+
+            usize found;
+            if(!line_index_offset_from_line(index, first + newlines_needed, &found)) {
+                // Either it's too far ahead or past the end of the text
+                usize total;
+                if(!line_index_line_from_offset(index, index->text.count, &total)) return 0;
+                if(first + newlines_needed <= total) return 0;
+                found = index->text.count + 1;
+            }
+            if(found <= piece->start + piece->count) {
+                *offset = piece_start + found - piece->start;
+                return 1;
+            }
+
+            usize last;
+            if(!line_index_line_from_offset(index, piece->start + piece->count, &last)) return 0;
+            newlines = last - first;
+        } else {
+            u8* at = piece_base(buffer, piece);
+            u8* end = at + piece->count;
+            newlines = 0;
+            while(newlines < newlines_needed) {
+                at = (u8*)memchr(at, '\n', end - at);
+                if(!at) break;
+                at++;
+                newlines++;
+            }
+            if(newlines == newlines_needed) {
+                *offset = piece_start + (at - piece_base(buffer, piece));
+                return 1;
+            }
+        }
+
+        lines_before += newlines;
+        piece_start += piece->count;
+    }
+    return 0;
+}
+
+// Saving
+//
+// Saves run on a worker thread, so writing a few gigabytes never blocks the
+// event loop. At save start we take a snapshot of the buffer: the piece array
+// is copied, and everything it points to (the original text and the added
+// buffer) never changes or moves, so the editor can keep editing while the
+// snapshot is being written out.
+enum Fsync_Policy {
+    // Leave it to the kernel, fastest but a crash right after saving may
+    // leave an empty file behind the rename
+    FSYNC_NONE,
+    // fdatasync before the rename, the contents are durable
+    FSYNC_DATA,
+    // fsync before the rename and fsync the directory after it, the rename
+    // itself is durable too
+    FSYNC_FULL,
+};
+
+Fsync_Policy save_fsync_policy = FSYNC_DATA;
+
+struct Buffer_Snapshot {
+    cstring path;
+    Text_Format format;
+    u8_array original;
+    int original_fd;
+    usize original_file_offset;
+    int original_is_copy;
+    u8* added;
+    Piece* pieces;
+    usize piece_count;
+    usize count;
+    u64 edit_count;
+};
+
+enum Save_State {
+    SAVE_IDLE,
+    SAVE_QUEUED,
+    SAVE_RUNNING,
+    SAVE_DONE,
+    SAVE_FAILED,
+};
+
+// Big copies are split so the progress bar has something to show
+#define SAVE_PROGRESS_STEP (64 * 1024 * 1024)
+
+struct Save_Worker {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    Buffer_Snapshot snapshot;
+    // Holds the snapshot's pieces, reset by every save
+    Arena arena;
+    Fsync_Policy fsync_policy;
+    // Both are accessed atomically
+    int state;
+    usize bytes_written;
+    // Set when the file we copy unchanged text from lost some of it, the
+    // save fails rather than writing zeros
+    int source_truncated;
+    // Signaled on progress and when the save is done, -1 if nobody waits
+    int wake_fd;
+};
+
+u8* snapshot_piece_base(Buffer_Snapshot* snapshot, Piece* piece) {
+    u8* base = piece->source == PIECE_ORIGINAL ? snapshot->original.base : snapshot->added;
+    return base + piece->start;
+}
+
+// The piece array goes on the arena, what it points to is shared
+void take_buffer_snapshot(Buffer_Snapshot* snapshot, Text_Buffer* buffer, Arena* arena) {
+    snapshot->path = buffer->path;
+    snapshot->format = buffer->format;
+    snapshot->original = buffer->original;
+    snapshot->original_fd = buffer->original_fd;
+    snapshot->original_file_offset = buffer->original_file_offset;
+    snapshot->original_is_copy = buffer->original_is_copy;
+    snapshot->added = buffer->added;
+    snapshot->piece_count = buffer->piece_count;
+    snapshot->pieces = arena_push_array(arena, Piece, buffer->piece_count);
+    memcpy(snapshot->pieces, buffer->pieces, buffer->piece_count * sizeof(Piece));
+    snapshot->count = buffer->count;
+    snapshot->edit_count = buffer->edit_count;
+}
+
+void save_progress(Save_Worker* worker, usize bytes) {
+    __atomic_fetch_add(&worker->bytes_written, bytes, __ATOMIC_RELAXED);
+    platform_signal_event(worker->wake_fd);
+}
+
+// Writes [offset, offset + count) of the original file into fd, in the
+// kernel if possible. copy_file_range also shares the extents instead of
+// copying (reflinks) on filesystems that support it, like btrfs and XFS.
+int copy_original_span(Save_Worker* worker, int fd, usize offset, usize count) {
+    static int copy_file_range_works = 1;
+    Buffer_Snapshot* snapshot = &worker->snapshot;
+
+    loff_t in_offset = snapshot->original_file_offset + offset;
+    while(count && copy_file_range_works) {
+        usize step = std::min(count, (usize)SAVE_PROGRESS_STEP);
+        ssize_t copied = copy_file_range(snapshot->original_fd, &in_offset, fd, 0, step, 0);
+        if(copied > 0) {
+            offset += copied;
+            count -= copied;
+            save_progress(worker, copied);
+            continue;
+        }
+        if(copied == 0) {
+            // File got shorter under us. A copy still has the text, a
+            // mapping has zeros there now.
+            if(snapshot->original_is_copy) break;
+            worker->source_truncated = 1;
+            return 0;
+        }
+        if(errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+           errno == EOPNOTSUPP || errno == EPERM) {
+            // Older kernels don't do cross-filesystem copies and some
+            // filesystems don't do it at all, go through the mapping instead
+            if(errno == ENOSYS) copy_file_range_works = 0;
+            break;
+        }
+        return 0;
+    }
+
+    platform_advise(snapshot->original.base + offset, count, ACCESS_SEQUENTIAL);
+    while(count) {
+        usize step = std::min(count, (usize)SAVE_PROGRESS_STEP);
+        // write() gets EFAULT on pages cut off by truncation, fault them in
+        // from here so the SIGBUS handler can replace them first
+        touch_guarded_pages(snapshot->original.base + offset, step);
+        if(mapping_is_truncated(snapshot->original.base + offset, step)) {
+            worker->source_truncated = 1;
+            return 0;
+        }
+        if(!platform_write_all(fd, snapshot->original.base + offset, step)) return 0;
+        offset += step;
+        count -= step;
+        save_progress(worker, step);
+    }
+    return 1;
+}
+
+int platform_writev_all(int fd, struct iovec* vectors, int vector_count) {
+    while(vector_count) {
+        ssize_t written = writev(fd, vectors, vector_count);
+        if(written < 0) return 0;
+        while(vector_count && (usize)written >= vectors->iov_len) {
+            written -= vectors->iov_len;
+            vectors++;
+            vector_count--;
+        }
+        if(vector_count) {
+            vectors->iov_base = (u8*)vectors->iov_base + written;
+            vectors->iov_len -= written;
+        }
+    }
+    return 1;
+}
+
+int write_pieces_zero_copy(Save_Worker* worker, int fd) {
+    Buffer_Snapshot* snapshot = &worker->snapshot;
+    if(snapshot->format.has_bom) {
+        u8 bom[] = {0xEF, 0xBB, 0xBF};
+        if(!platform_write_all(fd, bom, 3)) return 0;
+    }
+
+    // Added spans are batched into a single writev, original spans between
+    // them are copied by the kernel
+    struct iovec vectors[64];
+    int vector_count = 0;
+    usize vector_bytes = 0;
+    for(usize i = 0; i < snapshot->piece_count; i++) {
+        Piece* piece = &snapshot->pieces[i];
+        if(piece->source == PIECE_ADDED) {
+            if(vector_count == ARRAY_COUNT(vectors)) {
+                if(!platform_writev_all(fd, vectors, vector_count)) return 0;
+                save_progress(worker, vector_bytes);
+                vector_count = 0;
+                vector_bytes = 0;
+            }
+            vectors[vector_count++] = {snapshot_piece_base(snapshot, piece), piece->count};
+            vector_bytes += piece->count;
+            continue;
+        }
+
+        if(vector_count) {
+            if(!platform_writev_all(fd, vectors, vector_count)) return 0;
+            save_progress(worker, vector_bytes);
+            vector_count = 0;
+            vector_bytes = 0;
+        }
+        // Deleting text splits an original span in two, but inserting and
+        // deleting back leaves them adjacent, copy those in one go
+        usize start = piece->start;
+        usize count = piece->count;
+        while(i + 1 < snapshot->piece_count && snapshot->pieces[i + 1].source == PIECE_ORIGINAL &&
+              snapshot->pieces[i + 1].start == start + count) {
+            count += snapshot->pieces[++i].count;
+        }
+        if(!copy_original_span(worker, fd, start, count)) return 0;
+    }
+
+    if(vector_count) {
+        if(!platform_writev_all(fd, vectors, vector_count)) return 0;
+        save_progress(worker, vector_bytes);
+    }
+    return 1;
+}
+
+int write_pieces_transcoded(Save_Worker* worker, int fd) {
+    Buffer_Snapshot* snapshot = &worker->snapshot;
+    Text_Format format = snapshot->format;
+    if(!write_text_bom(fd, format)) return 0;
+    for(usize i = 0; i < snapshot->piece_count; i++) {
+        Piece* piece = &snapshot->pieces[i];
+        // Edits happen on code point boundaries, so pieces never cut
+        // sequences in half
+        u8_array text = {snapshot_piece_base(snapshot, piece), piece->count};
+        if(!write_text_transcoded(fd, text, format)) return 0;
+        save_progress(worker, piece->count);
+    }
+    return 1;
+}
+
+int platform_sync_directory_of(cstring path) {
+    char directory[4096];
+    cstring slash = strrchr(path, '/');
+    if(!slash) {
+        directory[0] = '.';
+        directory[1] = 0;
+    } else {
+        usize length = std::max((usize)(slash - path), (usize)1);
+        if(length >= sizeof(directory)) return 0;
+        memcpy(directory, path, length);
+        directory[length] = 0;
+    }
+
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    if(fd < 0) return 0;
+    int ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// Writes everything into a temporary file next to the original and renames
+// it over, so the file on disk is never half-written.
+int save_snapshot(Save_Worker* worker) {
+    Buffer_Snapshot* snapshot = &worker->snapshot;
+    char temp_path[4096];
+    int length = snprintf(temp_path, sizeof(temp_path), "%s.scame-XXXXXX", snapshot->path);
+    if(length >= (int)sizeof(temp_path)) return 0;
+
+    int fd = mkstemp(temp_path);
+    if(fd < 0) return 0;
+
+    int ok;
+    if(snapshot->original_fd >= 0) ok = write_pieces_zero_copy(worker, fd);
+    else ok = write_pieces_transcoded(worker, fd);
+
+    // Keep the permissions of the file we're replacing
+    struct stat statbuf;
+    if(ok && stat(snapshot->path, &statbuf) == 0) {
+        fchmod(fd, statbuf.st_mode & 07777);
+    }
+
+    if(ok && worker->fsync_policy == FSYNC_DATA) ok = fdatasync(fd) == 0;
+    if(ok && worker->fsync_policy == FSYNC_FULL) ok = fsync(fd) == 0;
+
+    if(close(fd) != 0) ok = 0;
+    if(ok && rename(temp_path, snapshot->path) != 0) ok = 0;
+    if(!ok) {
+        unlink(temp_path);
+        return 0;
+    }
+
+    if(worker->fsync_policy == FSYNC_FULL) ok = platform_sync_directory_of(snapshot->path);
+    return ok;
+}
+
+void* save_worker_proc(void* data) {
+    auto worker = (Save_Worker*)data;
+    pthread_mutex_lock(&worker->mutex);
+    while(1) {
+        while(__atomic_load_n(&worker->state, __ATOMIC_ACQUIRE) != SAVE_QUEUED) {
+            pthread_cond_wait(&worker->wake, &worker->mutex);
+        }
+        __atomic_store_n(&worker->state, SAVE_RUNNING, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&worker->mutex);
+
+        auto scope = begin_fault_scope(FAULT_SAVE);
+        int ok = save_snapshot(worker);
+        end_fault_scope(scope);
+
+        pthread_mutex_lock(&worker->mutex);
+        __atomic_store_n(&worker->state, ok ? SAVE_DONE : SAVE_FAILED, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&worker->wake);
+        platform_signal_event(worker->wake_fd);
+    }
+    return 0;
+}
+
+Save_Worker* make_save_worker(int wake_fd = -1) {
+    auto worker = (Save_Worker*)platform_allocate_bytes(sizeof(Save_Worker));
+    *worker = {};
+    worker->wake_fd = wake_fd;
+    worker->arena = make_arena(ARENA_DEFAULT_RESERVE, MEMORY_SAVE);
+    pthread_mutex_init(&worker->mutex, 0);
+    pthread_cond_init(&worker->wake, 0);
+    int err = pthread_create(&worker->thread, 0, save_worker_proc, worker);
+    assert(!err, "Couldn't start the save thread");
+    return worker;
+}
+
+int save_worker_busy(Save_Worker* worker) {
+    int state = __atomic_load_n(&worker->state, __ATOMIC_ACQUIRE);
+    return state == SAVE_QUEUED || state == SAVE_RUNNING;
+}
+
+// Returns 0 if the previous save is still running
+int buffer_save_async(Save_Worker* worker, Text_Buffer* buffer) {
+    pthread_mutex_lock(&worker->mutex);
+    if(save_worker_busy(worker)) {
+        pthread_mutex_unlock(&worker->mutex);
+        return 0;
+    }
+
+    arena_reset(&worker->arena);
+    take_buffer_snapshot(&worker->snapshot, buffer, &worker->arena);
+
+    worker->fsync_policy = save_fsync_policy;
+    __atomic_store_n(&worker->bytes_written, 0, __ATOMIC_RELAXED);
+    worker->source_truncated = 0;
+    __atomic_store_n(&worker->state, SAVE_QUEUED, __ATOMIC_RELEASE);
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->mutex);
+    return 1;
+}
+
+void save_worker_wait(Save_Worker* worker) {
+    pthread_mutex_lock(&worker->mutex);
+    while(save_worker_busy(worker)) {
+        pthread_cond_wait(&worker->wake, &worker->mutex);
+    }
+    pthread_mutex_unlock(&worker->mutex);
+}
+
+// Polled from the main loop. Returns SAVE_DONE or SAVE_FAILED once per
+// finished save, SAVE_IDLE otherwise.
+Save_State save_worker_poll(Save_Worker* worker, Text_Buffer* buffer) {
+    auto state = (Save_State)__atomic_load_n(&worker->state, __ATOMIC_ACQUIRE);
+    if(state != SAVE_DONE && state != SAVE_FAILED) return SAVE_IDLE;
+
+    // Whatever was typed while saving is still unsaved
+    if(state == SAVE_DONE) buffer->saved_edit_count = worker->snapshot.edit_count;
+    __atomic_store_n(&worker->state, SAVE_IDLE, __ATOMIC_RELEASE);
+    return state;
+}
+
+// Asynchronous loading
+//
+// Opening, reading and even the first page faults of a file can take
+// forever on network mounts, so all of it happens on a loader thread. The
+// first screen worth of bytes is read first and published as a preview, the
+// rest streams in the background with progress the UI can show. Once
+// everything is there, the loader builds the Text_Buffer and hands it over.
+//
+// Files up to LOADER_READ_LIMIT are read into memory with io_uring, keeping
+// a few reads in flight. Bigger ones are mapped instead, there the loader
+// only faults in the first screen.
+#define LOADER_READ_LIMIT (256 * 1024 * 1024)
+#define LOADER_FIRST_SCREEN_SIZE (128 * 1024)
+#define LOADER_READ_SIZE (1024 * 1024)
+#define LOADER_QUEUE_DEPTH 8
+// Address space only
+#define LOADER_GROWTH_RESERVE (64ull * 1024 * 1024 * 1024)
+
+enum Loader_State {
+    LOADER_OPENING,
+    LOADER_PREVIEW_READY,
+    LOADER_DONE,
+    LOADER_FAILED,
+};
+
+struct File_Loader {
+    cstring path;
+    pthread_t thread;
+    // Accessed atomically
+    int state;
+    usize bytes_loaded;
+    usize total;
+    // Valid from LOADER_PREVIEW_READY, already in the internal format
+    u8_array preview;
+    // The preview and the loader's own bookkeeping
+    Arena arena;
+    // Valid from LOADER_DONE
+    Text_Buffer* buffer;
+    // Signaled when the state or the progress changes, -1 if nobody waits
+    int wake_fd;
+};
+
+void loader_set_state(File_Loader* loader, Loader_State state) {
+    __atomic_store_n(&loader->state, state, __ATOMIC_RELEASE);
+    platform_signal_event(loader->wake_fd);
+}
+
+void loader_set_progress(File_Loader* loader, usize bytes_loaded) {
+    if(__atomic_exchange_n(&loader->bytes_loaded, bytes_loaded, __ATOMIC_ACQ_REL) != bytes_loaded) {
+        platform_signal_event(loader->wake_fd);
+    }
+}
+
+// Just enough of io_uring to read a file, without liburing
+struct Uring {
+    int fd;
+    u32* sq_head;
+    u32* sq_tail;
+    u32* sq_mask;
+    u32* sq_array;
+    io_uring_sqe* sqes;
+    u32* cq_head;
+    u32* cq_tail;
+    u32* cq_mask;
+    io_uring_cqe* cqes;
+    u32 in_flight;
+    u8_array sq_memory;
+    u8_array cq_memory;
+    u8_array sqe_memory;
+};
+
+int uring_init(Uring* ring, u32 entries) {
+    *ring = {};
+    io_uring_params params = {};
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0) return 0;
+
+    usize sq_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+    usize cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    int single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(single_mmap) sq_size = cq_size = std::max(sq_size, cq_size);
+
+    auto sq = (u8*)mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    auto cq = sq;
+    if(!single_mmap && sq != MAP_FAILED) {
+        cq = (u8*)mmap(0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_CQ_RING);
+    }
+    auto sqes = (io_uring_sqe*)mmap(0, params.sq_entries * sizeof(io_uring_sqe),
+                                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                    ring->fd, IORING_OFF_SQES);
+    if(sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(ring->fd);
+        return 0;
+    }
+
+    ring->sq_head = (u32*)(sq + params.sq_off.head);
+    ring->sq_tail = (u32*)(sq + params.sq_off.tail);
+    ring->sq_mask = (u32*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (u32*)(sq + params.sq_off.array);
+    ring->sqes = sqes;
+    ring->cq_head = (u32*)(cq + params.cq_off.head);
+    ring->cq_tail = (u32*)(cq + params.cq_off.tail);
+    ring->cq_mask = (u32*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    ring->sq_memory = {sq, sq_size};
+    ring->cq_memory = {single_mmap ? 0 : cq, cq_size};
+    ring->sqe_memory = {(u8*)sqes, params.sq_entries * sizeof(io_uring_sqe)};
+    return 1;
+}
+
+void uring_queue_read(Uring* ring, int fd, u8* dest, u32 count, usize offset, u64 user_data) {
+    u32 tail = *ring->sq_tail;
+    u32 index = tail & *ring->sq_mask;
+    io_uring_sqe* sqe = &ring->sqes[index];
+    *sqe = {};
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (u64)dest;
+    sqe->len = count;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->in_flight++;
+}
+
+// Submits everything queued and waits for at least one completion
+int uring_submit_and_wait(Uring* ring, u32 to_submit) {
+    int result;
+    do {
+        result = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1,
+                         IORING_ENTER_GETEVENTS, 0, 0);
+    } while(result < 0 && errno == EINTR);
+    return result >= 0;
+}
+
+int uring_next_completion(Uring* ring, io_uring_cqe* result) {
+    u32 head = *ring->cq_head;
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    *result = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    ring->in_flight--;
+    return 1;
+}
+
+void uring_destroy(Uring* ring) {
+    munmap(ring->sqe_memory.base, ring->sqe_memory.count);
+    if(ring->cq_memory.base) munmap(ring->cq_memory.base, ring->cq_memory.count);
+    munmap(ring->sq_memory.base, ring->sq_memory.count);
+    close(ring->fd);
+}
+
+void loader_publish_preview(File_Loader* loader, u8_array first_screen) {
+    loader->preview = transcode_to_internal(first_screen, detect_text_format(first_screen),
+                                            &loader->arena);
+    loader_set_state(loader, LOADER_PREVIEW_READY);
+}
+
+// Reads until count bytes or the end of the file, whichever comes first,
+// read_total says how far it got
+int platform_pread_until_end(int fd, u8* dest, usize count, usize offset, usize* read_total) {
+    *read_total = 0;
+    while(*read_total < count) {
+        ssize_t read_count = pread(fd, dest + *read_total, count - *read_total,
+                                   offset + *read_total);
+        if(read_count < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if(read_count < 0) return 0;
+        if(read_count == 0) break;
+        *read_total += read_count;
+    }
+    return 1;
+}
+
+// Reads [start, *end) keeping LOADER_QUEUE_DEPTH reads in flight.
+// Completions come back in any order, bytes_loaded only covers the
+// contiguous prefix. Whatever the ring can't read (kernels without
+// IORING_OP_READ, filtered rings, no ring at all) is read with pread after,
+// so the ring never fails a load that pread could do. If the file got
+// shorter in the meantime, *end moves to where it ends now.
+int loader_read_rest(File_Loader* loader, Uring* ring, int fd, u8* memory,
+                     usize start, usize* end) {
+    usize chunk_count = (*end - start + LOADER_READ_SIZE - 1) / LOADER_READ_SIZE;
+    Arena_Marker marker = arena_begin_temp(&loader->arena);
+    auto chunk_left = arena_push_array(&loader->arena, u32, chunk_count);
+    for(usize i = 0; i < chunk_count; i++) {
+        chunk_left[i] = std::min((usize)LOADER_READ_SIZE, *end - start - i * LOADER_READ_SIZE);
+    }
+    auto chunk_offset = [&](usize chunk) {
+        usize chunk_end = std::min(start + (chunk + 1) * LOADER_READ_SIZE, *end);
+        return chunk_end - chunk_left[chunk];
+    };
+
+    usize next_chunk = 0;
+    usize contiguous_chunks = 0;
+    u32 queued = 0;
+    while(ring && (next_chunk < chunk_count || ring->in_flight)) {
+        while(next_chunk < chunk_count && ring->in_flight < LOADER_QUEUE_DEPTH) {
+            usize offset = start + next_chunk * LOADER_READ_SIZE;
+            uring_queue_read(ring, fd, memory + offset, chunk_left[next_chunk], offset, next_chunk);
+            next_chunk++;
+            queued++;
+        }
+        if(!uring_submit_and_wait(ring, queued)) break;
+        queued = 0;
+
+        io_uring_cqe completion;
+        while(uring_next_completion(ring, &completion)) {
+            usize chunk = completion.user_data;
+            if(completion.res > 0) {
+                chunk_left[chunk] -= completion.res;
+            } else if(completion.res != -EINTR && completion.res != -EAGAIN) {
+                // Errors, and EOF if the file got shorter, pread sorts
+                // those out below
+                continue;
+            }
+            if(chunk_left[chunk]) {
+                // Short or interrupted read, ask for the rest
+                usize offset = chunk_offset(chunk);
+                uring_queue_read(ring, fd, memory + offset, chunk_left[chunk], offset, chunk);
+                queued++;
+            }
+        }
+
+        while(contiguous_chunks < chunk_count && chunk_left[contiguous_chunks] == 0) {
+            contiguous_chunks++;
+        }
+        usize loaded = std::min(start + contiguous_chunks * LOADER_READ_SIZE, *end);
+        loader_set_progress(loader, loaded);
+    }
+
+    // Don't leave reads writing into memory we're about to read into
+    // ourselves, or give up on
+    io_uring_cqe completion;
+    while(ring && ring->in_flight) {
+        if(!uring_submit_and_wait(ring, 0)) break;
+        while(uring_next_completion(ring, &completion)) {}
+    }
+
+    int ok = 1;
+    for(usize chunk = contiguous_chunks; chunk < chunk_count; chunk++) {
+        if(!chunk_left[chunk]) continue;
+        usize offset = chunk_offset(chunk);
+        usize read_total;
+        if(!platform_pread_until_end(fd, memory + offset, chunk_left[chunk], offset, &read_total)) {
+            ok = 0;
+            break;
+        }
+        if(read_total < chunk_left[chunk]) {
+            // The file ends here now, what came after can't be trusted
+            *end = offset + read_total;
+            break;
+        }
+        chunk_left[chunk] = 0;
+        loader_set_progress(loader, offset + read_total);
+    }
+
+    arena_end_temp(marker);
+    return ok;
+}
+
+// Reads the file into memory, size comes back smaller if the file got
+// shorter while we were at it
+int loader_read_file(File_Loader* loader, int fd, u8* memory, usize* size) {
+    // No io_uring (old kernel or disabled by seccomp) means plain reads on
+    // this thread, which still keep the UI going
+    Uring ring;
+    Uring* ring_pointer = uring_init(&ring, LOADER_QUEUE_DEPTH) ? &ring : 0;
+
+    // The first screen goes alone, so nothing competes with it
+    usize first_screen = std::min(*size, (usize)LOADER_FIRST_SCREEN_SIZE);
+    usize first_screen_end = first_screen;
+    int ok = loader_read_rest(loader, ring_pointer, fd, memory, 0, &first_screen_end);
+    if(ok) {
+        loader_publish_preview(loader, {memory, first_screen_end});
+        if(first_screen_end < first_screen) *size = first_screen_end;
+        else ok = loader_read_rest(loader, ring_pointer, fd, memory, first_screen, size);
+    }
+    if(ring_pointer) uring_destroy(ring_pointer);
+    return ok;
+}
+
+void* file_loader_proc(void* data) {
+    auto loader = (File_Loader*)data;
+    auto scope = begin_fault_scope(FAULT_LOAD);
+
+    Mapped_File file = {};
+    file.fd = open(loader->path, O_RDONLY);
+    struct stat statbuf;
+    if(file.fd < 0 || fstat(file.fd, &statbuf) != 0) {
+        loader_set_state(loader, LOADER_FAILED);
+        return 0;
+    }
+    usize size = statbuf.st_size;
+    __atomic_store_n(&loader->total, size, __ATOMIC_RELEASE);
+
+    // Leave room after the file, so a log that keeps growing can be
+    // followed in place, see buffer_follow_file
+    file.capacity = size + LOADER_GROWTH_RESERVE;
+    file.data = {platform_reserve_bytes(file.capacity), size};
+    if(size > LOADER_READ_LIMIT) {
+        auto memory = (u8*)mmap(file.data.base, size, PROT_READ, MAP_SHARED | MAP_FIXED,
+                                file.fd, 0);
+        if(memory == MAP_FAILED) {
+            loader_set_state(loader, LOADER_FAILED);
+            return 0;
+        }
+        guard_mapping(memory, size);
+
+        // Take the page faults for the first screen here rather than on the
+        // main thread
+        usize first_screen = std::min(size, (usize)LOADER_FIRST_SCREEN_SIZE);
+        platform_advise(memory, first_screen, ACCESS_WILL_NEED);
+        touch_guarded_pages(memory, first_screen);
+        loader_set_progress(loader, size);
+        loader_publish_preview(loader, {memory, first_screen});
+    } else {
+        file.is_copy = 1;
+        memory_commit(MEMORY_TEXT, size);
+        if(size && !loader_read_file(loader, file.fd, file.data.base, &file.data.count)) {
+            loader_set_state(loader, LOADER_FAILED);
+            return 0;
+        }
+        // Truncated while loading, we have what's there now, following
+        // picks up whatever gets written after
+        if(file.data.count < size) {
+            memory_decommit(MEMORY_TEXT, size - file.data.count);
+            __atomic_store_n(&loader->total, file.data.count, __ATOMIC_RELEASE);
+        }
+    }
+
+    // The descriptor stays open, the save engine copies unchanged spans from it
+    loader->buffer = make_text_buffer(loader->path, file);
+    end_fault_scope(scope);
+    loader_set_state(loader, LOADER_DONE);
+    return 0;
+}
+
+File_Loader* start_file_loader(cstring path, int wake_fd = -1) {
+    auto loader = (File_Loader*)platform_allocate_bytes(sizeof(File_Loader));
+    *loader = {};
+    loader->path = path;
+    loader->wake_fd = wake_fd;
+    loader->arena = make_arena(ARENA_DEFAULT_RESERVE, MEMORY_LOADER);
+    loader->state = LOADER_OPENING;
+    int err = pthread_create(&loader->thread, 0, file_loader_proc, loader);
+    assert(!err, "Couldn't start the file loading thread");
+    return loader;
+}
+
+// Change detection
+//
+// When a file changes under an open buffer, we don't throw the buffer away.
+// Both versions get cut into content-defined chunks, so an insertion only
+// changes the chunks around it and everything after lines up again. Chunks
+// are compared by hash, the ones that don't match are narrowed down to the
+// bytes that actually differ, and those get applied as ordinary edits.
+// Cursors and marks move with the text and the whole reload is one undo step.
+#define CHUNK_MIN_SIZE 1024
+#define CHUNK_MAX_SIZE (64 * 1024)
+struct Text_Chunk {
+    usize start;
+    usize count;
+    u64 hash;
+};
+
+// Chunks end after a line that looks "special" to a hash of its length and
+// its first and last 8 bytes, about one line in 128. What decides a boundary
+// is the text right there, not its position, so boundaries survive
+// insertions before them. memchr does the scanning, the hash is only
+// computed per line. Lines often share their start (indentation) or their
+// end (a semicolon), which is why it takes both.
+Text_Chunk* chunk_text(Arena* arena, u8_array text, usize* chunk_count) {
+    usize capacity = text.count / CHUNK_MIN_SIZE + 2;
+    auto chunks = arena_push_array(arena, Text_Chunk, capacity);
+    usize count = 0;
+
+    usize start = 0;
+    while(start < text.count) {
+        usize end = std::min(start + CHUNK_MAX_SIZE, text.count);
+        usize at = std::min(start + CHUNK_MIN_SIZE, end);
+        auto previous_newline = (u8*)memrchr(text.base + start, '\n', at - start);
+        usize line_start = previous_newline ? previous_newline - text.base + 1 : start;
+        while(at < end) {
+            auto newline = (u8*)memchr(text.base + at, '\n', end - at);
+            if(!newline) {
+                at = end;
+                break;
+            }
+            at = newline - text.base + 1;
+            usize line_count = at - line_start;
+            usize edge_count = std::min(line_count, (usize)8);
+            u64 head = 0;
+            u64 tail = 0;
+            memcpy(&head, text.base + line_start, edge_count);
+            memcpy(&tail, text.base + at - edge_count, edge_count);
+            line_start = at;
+            u64 line_hash = hash_mix(head ^ HASH_PRIME_2, tail ^ (line_count * HASH_PRIME_1));
+            if(line_hash >> 57 == 0) break;
+        }
+
+        chunks[count++] = {start, at - start, hash_bytes(text.base + start, at - start)};
+        start = at;
+    }
+
+    *chunk_count = count;
+    return chunks;
+}
+
+struct Text_Change {
+    usize old_offset;
+    usize old_count;
+    usize new_offset;
+    usize new_count;
+};
+
+// The changes are pushed one after another onto an arena that nothing else
+// pushes to while diffing, so they stay one array
+struct Text_Changes {
+    Arena* arena;
+    Text_Change* changes;
+    usize count;
+};
+
+// Narrows a changed region down to the bytes that differ before recording it
+void add_text_change(Text_Changes* result, u8_array old_text, u8_array new_text,
+                     usize old_start, usize old_end, usize new_start, usize new_end) {
+    while(old_start < old_end && new_start < new_end &&
+          old_text.base[old_start] == new_text.base[new_start]) {
+        old_start++;
+        new_start++;
+    }
+    while(old_end > old_start && new_end > new_start &&
+          old_text.base[old_end - 1] == new_text.base[new_end - 1]) {
+        old_end--;
+        new_end--;
+    }
+    if(old_start == old_end && new_start == new_end) return;
+
+    auto change = arena_push_struct(result->arena, Text_Change);
+    if(!result->count) result->changes = change;
+    result->count++;
+    *change = {old_start, old_end - old_start, new_start, new_end - new_start};
+}
+
+// Changes that turn old_text into new_text, in order and not overlapping.
+// Chunks matching at both ends are skipped. In between, each new chunk is
+// looked up among the old ones after the last match, so a few scattered
+// edits come out as a few small changes. It's not a minimal diff, moved
+// blocks show up as a delete and an insert, but it's linear. Everything,
+// the result included, goes on the arena, meant to be a temporary one.
+Text_Changes diff_text(Arena* arena, u8_array old_text, u8_array new_text) {
+    usize old_count, new_count;
+    Text_Chunk* old_chunks = chunk_text(arena, old_text, &old_count);
+    Text_Chunk* new_chunks = chunk_text(arena, new_text, &new_count);
+    auto same = [](Text_Chunk* a, Text_Chunk* b) {
+        return a->hash == b->hash && a->count == b->count;
+    };
+
+    usize prefix = 0;
+    while(prefix < old_count && prefix < new_count &&
+          same(&old_chunks[prefix], &new_chunks[prefix])) {
+        prefix++;
+    }
+    usize suffix = 0;
+    while(suffix < old_count - prefix && suffix < new_count - prefix &&
+          same(&old_chunks[old_count - 1 - suffix], &new_chunks[new_count - 1 - suffix])) {
+        suffix++;
+    }
+    usize old_end = old_count - suffix;
+    usize new_end = new_count - suffix;
+
+    // Old chunk hash -> index + 1, open addressing. Only the first of equal
+    // chunks is kept, later ones just don't get matched.
+    usize table_size = 16;
+    while(table_size < (old_end - prefix) * 2) table_size *= 2;
+    auto table = arena_push_array(arena, usize, table_size);
+    memset(table, 0, table_size * sizeof(usize));
+    for(usize i = prefix; i < old_end; i++) {
+        usize slot = old_chunks[i].hash & (table_size - 1);
+        while(table[slot] && !same(&old_chunks[table[slot] - 1], &old_chunks[i])) {
+            slot = (slot + 1) & (table_size - 1);
+        }
+        if(!table[slot]) table[slot] = i + 1;
+    }
+
+    Text_Changes result = {};
+    result.arena = arena;
+    usize old_at = prefix;
+    usize new_at = prefix;
+    for(usize i = prefix; i < new_end; i++) {
+        usize slot = new_chunks[i].hash & (table_size - 1);
+        while(table[slot] && !same(&old_chunks[table[slot] - 1], &new_chunks[i])) {
+            slot = (slot + 1) & (table_size - 1);
+        }
+        if(!table[slot] || table[slot] - 1 < old_at) continue;
+
+        usize match = table[slot] - 1;
+        usize old_offset = old_at < old_count ? old_chunks[old_at].start : old_text.count;
+        add_text_change(&result, old_text, new_text, old_offset, old_chunks[match].start,
+                        new_chunks[new_at].start, new_chunks[i].start);
+        old_at = match + 1;
+        new_at = i + 1;
+    }
+    usize old_offset = old_at < old_count ? old_chunks[old_at].start : old_text.count;
+    usize old_limit = old_end < old_count ? old_chunks[old_end].start : old_text.count;
+    usize new_offset = new_at < new_count ? new_chunks[new_at].start : new_text.count;
+    usize new_limit = new_end < new_count ? new_chunks[new_end].start : new_text.count;
+    add_text_change(&result, old_text, new_text, old_offset, old_limit, new_offset, new_limit);
+    return result;
+}
+
+// Reading and diffing a big file takes a while, so that happens on a thread
+// of its own, working on a snapshot of the buffer like saving does. Only
+// applying the changes happens on the editor thread, and only if nothing
+// was typed meanwhile.
+enum Reload_State {
+    RELOAD_IDLE,
+    RELOAD_RUNNING,
+    RELOAD_DONE,
+    RELOAD_FAILED,
+};
+
+struct File_Reloader {
+    pthread_t thread;
+    // Accessed atomically
+    int state;
+    Buffer_Snapshot snapshot;
+    // Holds the snapshot's pieces, reset by every reload
+    Arena arena;
+    // Both versions of the text and the diff, made by the thread once it
+    // knows how big the file is, freed once the reload is applied
+    Arena text_arena;
+    // Valid from RELOAD_DONE
+    Mapped_File file;
+    Text_Format format;
+    u8_array new_text;
+    Text_Changes diff;
+    // The file was rewritten in place, so the descriptor doesn't have the
+    // original text anymore
+    int rewritten;
+    // And the original is a mapping of it, which shows the new text
+    // already (zeros where it got shorter). There's no old text to diff
+    // then, the buffer starts over with the new file.
+    int original_lost;
+    // Signaled when the reload is done, -1 if nobody waits
+    int wake_fd;
+};
+
+void reloader_set_state(File_Reloader* reloader, Reload_State state) {
+    __atomic_store_n(&reloader->state, state, __ATOMIC_RELEASE);
+    platform_signal_event(reloader->wake_fd);
+}
+
+void* file_reloader_proc(void* data) {
+    auto reloader = (File_Reloader*)data;
+    auto snapshot = &reloader->snapshot;
+    auto scope = begin_fault_scope(FAULT_LOAD);
+    if(!platform_open_mapped_file(snapshot->path, &reloader->file)) {
+        end_fault_scope(scope);
+        reloader_set_state(reloader, RELOAD_FAILED);
+        return 0;
+    }
+
+    // Transcoding takes at most twice the bytes, chunks and the diff are
+    // small next to the text
+    Mapped_File* file = &reloader->file;
+    reloader->text_arena = make_arena(ARENA_DEFAULT_RESERVE + 2 * (snapshot->count + file->data.count),
+                                      MEMORY_SCRATCH);
+    Arena* arena = &reloader->text_arena;
+    reloader->format = detect_text_format(file->data);
+    reloader->new_text = transcode_to_internal(file->data, reloader->format, arena);
+
+    // If it was replaced instead, the old file is still there behind the
+    // descriptor and all is fine
+    struct stat old_stat, new_stat;
+    reloader->rewritten = snapshot->original_fd >= 0 &&
+        (fstat(snapshot->original_fd, &old_stat) != 0 || fstat(file->fd, &new_stat) != 0 ||
+         (old_stat.st_dev == new_stat.st_dev && old_stat.st_ino == new_stat.st_ino));
+    reloader->original_lost = reloader->rewritten && !snapshot->original_is_copy;
+
+    if(!reloader->original_lost) {
+        // The diff wants the current text in one piece, which it already
+        // is unless there were saved edits
+        u8_array old_text = {};
+        if(snapshot->piece_count == 1) {
+            old_text = {snapshot_piece_base(snapshot, &snapshot->pieces[0]), snapshot->count};
+        } else if(snapshot->count) {
+            old_text = {arena_push(arena, snapshot->count, 1), snapshot->count};
+            usize at = 0;
+            for(usize i = 0; i < snapshot->piece_count; i++) {
+                Piece* piece = &snapshot->pieces[i];
+                memcpy(old_text.base + at, snapshot_piece_base(snapshot, piece), piece->count);
+                at += piece->count;
+            }
+        }
+        reloader->diff = diff_text(arena, old_text, reloader->new_text);
+    }
+
+    end_fault_scope(scope);
+    reloader_set_state(reloader, RELOAD_DONE);
+    return 0;
+}
+
+File_Reloader* make_file_reloader(int wake_fd = -1) {
+    auto reloader = (File_Reloader*)platform_allocate_bytes(sizeof(File_Reloader));
+    *reloader = {};
+    reloader->wake_fd = wake_fd;
+    reloader->arena = make_arena(ARENA_DEFAULT_RESERVE, MEMORY_SCRATCH);
+    return reloader;
+}
+
+int file_reloader_busy(File_Reloader* reloader) {
+    return __atomic_load_n(&reloader->state, __ATOMIC_ACQUIRE) == RELOAD_RUNNING;
+}
+
+// Returns 0 if the buffer has changes of its own, we're not going to guess
+// how to merge those, or if the previous reload is still running
+int buffer_reload_async(File_Reloader* reloader, Text_Buffer* buffer) {
+    if(buffer_is_modified(buffer) || file_reloader_busy(reloader)) return 0;
+    arena_reset(&reloader->arena);
+    take_buffer_snapshot(&reloader->snapshot, buffer, &reloader->arena);
+    reloader->file = {};
+    reloader->diff = {};
+    __atomic_store_n(&reloader->state, RELOAD_RUNNING, __ATOMIC_RELEASE);
+    int err = pthread_create(&reloader->thread, 0, file_reloader_proc, reloader);
+    assert(!err, "Couldn't start the reloading thread");
+    return 1;
+}
+
+// The mapping of the original file doesn't have the text the buffer
+// refers to anymore, so the buffer gets the new file for its original:
+// one piece over all of it and a new line index. Undo goes too, it only
+// knows how to get back to text that's gone.
+void buffer_replace_original(Text_Buffer* buffer, File_Reloader* reloader) {
+    // The index's thread may still be counting the old mapping
+    free_line_index(buffer->line_index);
+    u8* old_file_base = buffer->original.base - buffer->original_file_offset;
+    usize old_file_count = buffer->original_file_offset + buffer->original.count;
+    if(old_file_count) {
+        resize_guarded_mapping(old_file_base, 0);
+        munmap(old_file_base, old_file_count);
+    }
+    close(buffer->original_fd);
+    buffer->original_fd = -1;
+
+    Mapped_File* file = &reloader->file;
+    u8_array text = reloader->new_text;
+    if(reloader->format.encoding == TEXT_ENCODING_UTF8 && !reloader->format.crlf) {
+        // Keeps the mapping, it's the original now
+        buffer->original_fd = file->fd;
+        buffer->original_file_offset = text.base - file->data.base;
+        buffer->original_is_copy = 0;
+        *file = {};
+    } else {
+        // Transcoded into the reloader's memory, which is about to go
+        u8* copy = arena_push(&buffer->arena, text.count, 1);
+        memcpy(copy, text.base, text.count);
+        text.base = copy;
+    }
+    buffer->original = text;
+    buffer->original_capacity = 0;
+    buffer->line_index = make_line_index(&buffer->arena, text, 0);
+
+    buffer->piece_count = 0;
+    if(text.count) {
+        buffer->pieces[0] = {PIECE_ORIGINAL, 0, text.count};
+        buffer->piece_count = 1;
+    }
+    buffer->count = text.count;
+    buffer->undo_count = 0;
+    buffer->undo_total = 0;
+    buffer->undo_piece_count = 0;
+    buffer->edit_count++;
+    for(usize i = 0; i < buffer->mark_count; i++) {
+        usize* mark = buffer->marks[i];
+        *mark = buffer_line_start(buffer, std::min(*mark, buffer->count));
+    }
+}
+
+// Brings the buffer up to date with what the reloader read, by editing
+// only what changed. Returns 0 if it was edited since the reload started.
+int buffer_apply_reload(Text_Buffer* buffer, File_Reloader* reloader) {
+    if(buffer->edit_count != reloader->snapshot.edit_count) return 0;
+
+    Text_Format format = reloader->format;
+    Mapped_File* file = &reloader->file;
+    struct stat file_stat;
+    int has_file_stat = fstat(file->fd, &file_stat) == 0;
+    usize check_count = std::min(file->data.count, (usize)FOLLOW_CHECK_SIZE);
+    u64 check_hash = hash_bytes(file->data.base + file->data.count - check_count, check_count);
+    // Either way the original text is done growing, following goes on
+    // with the file we just read, from where it ends now
+    if(buffer->follow_fd >= 0 && buffer->follow_fd != buffer->original_fd) {
+        close(buffer->follow_fd);
+    }
+    buffer->follow_fd = -1;
+    if(format.encoding == TEXT_ENCODING_UTF8 && !format.crlf) {
+        buffer->follow_fd = fcntl(file->fd, F_DUPFD_CLOEXEC, 0);
+        buffer->follow_file_count = file->data.count;
+        if(has_file_stat) buffer->follow_modified = file_stat.st_mtim;
+        buffer->follow_check_hash = check_hash;
+    }
+
+    if(reloader->original_lost) {
+        buffer_replace_original(buffer, reloader);
+    } else {
+        // From the back, so offsets of the changes still to go don't move
+        Text_Changes diff = reloader->diff;
+        u8_array new_text = reloader->new_text;
+        buffer_begin_undo_group(buffer);
+        for(usize i = diff.count; i > 0; i--) {
+            Text_Change* change = &diff.changes[i - 1];
+            buffer_delete(buffer, change->old_offset, change->old_count);
+            buffer_insert(buffer, change->old_offset,
+                          String {new_text.base + change->new_offset, change->new_count});
+        }
+        buffer_begin_undo_group(buffer);
+
+        // Saving can't copy from a descriptor that doesn't have the original
+        // text anymore, nor from one the original isn't verbatim of
+        if(format.encoding != buffer->format.encoding || format.crlf != buffer->format.crlf ||
+           reloader->rewritten) {
+            if(reloader->rewritten) close(buffer->original_fd);
+            buffer->original_fd = -1;
+        }
+    }
+
+    buffer->original_capacity = 0;
+    // What's in the buffer is what's on disk again
+    buffer->format = format;
+    buffer->saved_edit_count = buffer->edit_count;
+    return 1;
+}
+
+// Polled from the main loop. Applies a finished reload and returns
+// RELOAD_DONE or RELOAD_FAILED once per reload, RELOAD_IDLE otherwise.
+// Failed covers a file that couldn't be read and a buffer edited meanwhile.
+Reload_State file_reloader_poll(File_Reloader* reloader, Text_Buffer* buffer) {
+    auto state = (Reload_State)__atomic_load_n(&reloader->state, __ATOMIC_ACQUIRE);
+    if(state != RELOAD_DONE && state != RELOAD_FAILED) return RELOAD_IDLE;
+    pthread_join(reloader->thread, 0);
+    if(state == RELOAD_DONE) {
+        if(!buffer_apply_reload(buffer, reloader)) state = RELOAD_FAILED;
+        // Unless the buffer kept the mapping as its new original
+        if(reloader->file.data.base) platform_close_mapped_file(&reloader->file);
+        free_arena(&reloader->text_arena);
+    }
+    __atomic_store_n(&reloader->state, RELOAD_IDLE, __ATOMIC_RELEASE);
+    return state;
+}
+
+// File watching
+//
+// inotify on the file tells us when it's written to, on its directory when
+// something else gets renamed over it (editors saving atomically, log
+// rotation). Growth of a file we have verbatim is followed in place: the new
+// bytes get read or mapped right after the old ones, the line index only
+// counts what's new, and the last original piece gets longer. So following
+// a log never goes back to byte zero. After a rotation or a rewrite, the
+// buffer follows the new file the reload read, its growth goes into added.
+#define FOLLOW_MAX_READ (64 * 1024 * 1024)
+
+enum File_Change_Flags {
+    FILE_CHANGE_WRITTEN = 1,
+    FILE_CHANGE_REPLACED = 2,
+};
+
+struct File_Watcher {
+    int inotify_fd;
+    int file_watch;
+    int directory_watch;
+    cstring path;
+    // The file's name in its directory, which directory events are about
+    cstring name;
+    // What we think is at the path, so our own saves don't get reported as
+    // somebody replacing the file
+    dev_t device;
+    ino_t inode;
+};
+
+void file_watcher_rewatch(File_Watcher* watcher) {
+    if(watcher->inotify_fd < 0) return;
+    if(watcher->file_watch >= 0) inotify_rm_watch(watcher->inotify_fd, watcher->file_watch);
+    watcher->file_watch = inotify_add_watch(watcher->inotify_fd, watcher->path,
+                                            IN_MODIFY | IN_DELETE_SELF | IN_MOVE_SELF);
+    struct stat statbuf;
+    if(stat(watcher->path, &statbuf) == 0) {
+        watcher->device = statbuf.st_dev;
+        watcher->inode = statbuf.st_ino;
+    }
+}
+
+File_Watcher* make_file_watcher(cstring path) {
+    auto watcher = (File_Watcher*)platform_allocate_bytes(sizeof(File_Watcher));
+    *watcher = {};
+    watcher->path = path;
+    watcher->file_watch = -1;
+    watcher->directory_watch = -1;
+    // Without inotify (too many watches, no permissions) we just don't
+    // notice changes, same as before
+    watcher->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(watcher->inotify_fd < 0) return watcher;
+
+    char directory[PATH_MAX];
+    usize length = strlen(path);
+    if(length >= sizeof(directory)) return watcher;
+    memcpy(directory, path, length + 1);
+    cstring slash = strrchr(directory, '/');
+    if(slash) {
+        watcher->name = (cstring)path + (slash - directory) + 1;
+        slash[slash == directory ? 1 : 0] = 0;
+    } else {
+        watcher->name = path;
+        strcpy(directory, ".");
+    }
+    watcher->directory_watch = inotify_add_watch(watcher->inotify_fd, directory,
+                                                 IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+
+    file_watcher_rewatch(watcher);
+    return watcher;
+}
+
+// Returns File_Change_Flags of what happened since the last call
+int file_watcher_poll(File_Watcher* watcher) {
+    if(watcher->inotify_fd < 0) return 0;
+
+    int flags = 0;
+    int check_identity = 0;
+    alignas(inotify_event) char events[4096];
+    while(1) {
+        ssize_t count = read(watcher->inotify_fd, events, sizeof(events));
+        if(count <= 0) break;
+        for(char* at = events; at < events + count;) {
+            auto event = (inotify_event*)at;
+            if(event->wd == watcher->file_watch) {
+                if(event->mask & IN_MODIFY) flags |= FILE_CHANGE_WRITTEN;
+                if(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) check_identity = 1;
+            } else if(event->wd == watcher->directory_watch && event->len &&
+                      !strcmp(event->name, watcher->name)) {
+                check_identity = 1;
+            }
+            at += sizeof(inotify_event) + event->len;
+        }
+    }
+
+    if(check_identity) {
+        struct stat statbuf;
+        if(stat(watcher->path, &statbuf) != 0 || statbuf.st_dev != watcher->device ||
+           statbuf.st_ino != watcher->inode) {
+            flags |= FILE_CHANGE_REPLACED;
+            file_watcher_rewatch(watcher);
+        }
+    }
+    return flags;
+}
+
+// Picks up whatever got appended to the file since we last looked.
+// Returns how many bytes were added to the end of the text. Sets
+// rewritten if the file changed in a way that isn't an append, or can't
+// be followed at all, then only a reload can catch up with it.
+usize buffer_follow_file(Text_Buffer* buffer, int* rewritten) {
+    // Transcoded text can't be extended with what's on disk
+    if(buffer->follow_fd < 0) {
+        *rewritten = 1;
+        return 0;
+    }
+
+    struct stat statbuf;
+    if(fstat(buffer->follow_fd, &statbuf) != 0) return 0;
+    usize file_count = buffer->follow_file_count;
+    int in_place = buffer->follow_fd == buffer->original_fd && buffer->original_capacity;
+    // Shorter than what we have is no append, and neither is growth when
+    // the end of what we have isn't there anymore (truncated and written
+    // past the old size between two looks)
+    if((usize)statbuf.st_size < file_count ||
+       (in_place && mapping_is_truncated(buffer->original.base, buffer->original.count))) {
+        *rewritten = 1;
+        return 0;
+    }
+    // Checked even when the size didn't change, rewriting a file with
+    // something just as long is no append either. The hash catches
+    // changes near the end, the time any others.
+    u8 tail[FOLLOW_CHECK_SIZE];
+    usize tail_count = std::min(file_count, (usize)FOLLOW_CHECK_SIZE);
+    if(pread(buffer->follow_fd, tail, tail_count, file_count - tail_count) != (ssize_t)tail_count ||
+       hash_bytes(tail, tail_count) != buffer->follow_check_hash) {
+        *rewritten = 1;
+        return 0;
+    }
+    if((usize)statbuf.st_size == file_count) {
+        if(statbuf.st_mtim.tv_sec != buffer->follow_modified.tv_sec ||
+           statbuf.st_mtim.tv_nsec != buffer->follow_modified.tv_nsec) {
+            *rewritten = 1;
+        }
+        return 0;
+    }
+
+    // What we have may end in the middle of a code point, that one's
+    // start gets validated along with the new bytes that finish it
+    usize carried = tail_count - utf8_complete_length(u8_array {tail, tail_count});
+    u8_array text;
+    Arena_Marker added_marker = arena_begin_temp(&buffer->added_arena);
+    if(in_place) {
+        usize file_capacity = buffer->original_file_offset + buffer->original_capacity;
+        usize new_file_count = std::min((usize)statbuf.st_size, file_capacity);
+        u8* file_base = buffer->original.base - buffer->original_file_offset;
+        if(buffer->original_is_copy) {
+            // Bounded, so a file that grew by gigabytes while we weren't
+            // looking doesn't stall a frame, the rest comes next time
+            new_file_count = std::min(new_file_count, file_count + FOLLOW_MAX_READ);
+            ssize_t read_count = pread(buffer->follow_fd, file_base + file_count,
+                                       new_file_count - file_count, file_count);
+            if(read_count <= 0) return 0;
+            memory_commit(MEMORY_TEXT, read_count);
+            new_file_count = file_count + read_count;
+        } else {
+            // The last page was partially mapped, map it again along with the rest
+            usize map_start = file_count & ~(usize)(PLATFORM_PAGE_SIZE - 1);
+            void* memory = mmap(file_base + map_start, new_file_count - map_start, PROT_READ,
+                                MAP_SHARED | MAP_FIXED, buffer->follow_fd, map_start);
+            if(memory == MAP_FAILED) return 0;
+            resize_guarded_mapping(file_base, new_file_count);
+        }
+        text = {file_base + file_count - carried, new_file_count - file_count + carried};
+    } else {
+        // A file that isn't the original, its new text is read into added
+        usize read_size = std::min((usize)statbuf.st_size - file_count, (usize)FOLLOW_MAX_READ);
+        u8* base = arena_push(&buffer->added_arena, read_size + carried, 1);
+        ssize_t read_count = pread(buffer->follow_fd, base, read_size + carried,
+                                   file_count - carried);
+        if(read_count <= 0) {
+            arena_end_temp(added_marker);
+            return 0;
+        }
+        text = {base, (usize)read_count};
+    }
+
+    // Only whole code points, the rest of a cut off one comes next time
+    text.count = utf8_complete_length(text);
+    if(text.count <= carried) {
+        arena_end_temp(added_marker);
+        return 0;
+    }
+    if(!utf8_validate(text)) {
+        arena_end_temp(added_marker);
+        // Not UTF-8 anymore, the reload transcodes it
+        *rewritten = 1;
+        return 0;
+    }
+    usize appended = text.count - carried;
+    u8* appended_base = text.base + carried;
+
+    Piece piece;
+    if(in_place) {
+        piece = {PIECE_ORIGINAL, buffer->original.count, appended};
+        buffer->original.count += appended;
+        line_index_append(buffer->line_index, buffer->original);
+    } else {
+        // Whatever the cut off code point left over is given back
+        arena_end_temp(added_marker);
+        arena_push(&buffer->added_arena, text.count, 1);
+        piece = {PIECE_ADDED, (usize)(appended_base - buffer->added), appended};
+    }
+    Piece* last = buffer->piece_count ? &buffer->pieces[buffer->piece_count - 1] : 0;
+    if(last && last->source == piece.source && last->start + last->count == piece.start) {
+        last->count += appended;
+    } else {
+        // Something was typed at the end, the file's new text goes after it
+        buffer_insert_pieces(buffer, buffer->piece_count, 1);
+        buffer->pieces[buffer->piece_count - 1] = piece;
+    }
+    buffer->count += appended;
+
+    // The check window moves to the new end, over what's left of the old
+    // one followed by the new bytes
+    buffer->follow_file_count = file_count + appended;
+    buffer->follow_modified = statbuf.st_mtim;
+    if(appended >= FOLLOW_CHECK_SIZE) {
+        buffer->follow_check_hash = hash_bytes(appended_base + appended - FOLLOW_CHECK_SIZE,
+                                               FOLLOW_CHECK_SIZE);
+    } else {
+        usize keep = std::min(tail_count, FOLLOW_CHECK_SIZE - appended);
+        memmove(tail, tail + tail_count - keep, keep);
+        memcpy(tail + keep, appended_base, appended);
+        buffer->follow_check_hash = hash_bytes(tail, keep + appended);
+    }
+    return appended;
+}
+
+// Text view
+struct Text_View {
+    Text_Buffer* buffer;
+    Save_Worker* save_worker;
+    // Byte offset of the first visible line
+    usize top;
+    usize cursor;
+    // Set with Ctrl+Space
+    usize mark;
+    // Consecutive letters are undone together
+    int was_typing;
+    // "Go to line" that couldn't be resolved yet because the line index
+    // hasn't reached it. Retried every frame.
+    usize pending_jump_line;
+    int has_pending_jump;
+    // Shown in the status bar until the next key press
+    cstring message;
+};
+
+#define TEXT_VIEW_PREFETCH_SIZE (64 * 1024)
+
+void text_view_set_buffer(Text_View* view, Text_Buffer* buffer) {
+    view->buffer = buffer;
+    view->top = 0;
+    view->cursor = 0;
+    view->mark = 0;
+    // Reloads and undo move these with the text
+    buffer_add_mark(buffer, &view->top);
+    buffer_add_mark(buffer, &view->cursor);
+    buffer_add_mark(buffer, &view->mark);
+}
+
+void text_view_scroll(Text_View* view, s32 line_delta) {
+    auto buffer = view->buffer;
+    auto scope = begin_fault_scope(FAULT_SCROLL);
+    for(; line_delta > 0; line_delta--) {
+        usize newline = buffer_find_forward(buffer, view->top, '\n');
+        if(newline == buffer->count) break;
+        view->top = newline + 1;
+    }
+
+    for(; line_delta < 0; line_delta++) {
+        if(view->top == 0) break;
+        // Skip the newline that ends the previous line
+        view->top = buffer_line_start(buffer, view->top - 1);
+    }
+
+    buffer_touch_lines(buffer, view->top, view->top + 1);
+    // Whichever way we're going, the next screen is probably next
+    usize prefetch_start = view->top - std::min(view->top, (usize)TEXT_VIEW_PREFETCH_SIZE);
+    buffer_prefetch(buffer, prefetch_start, 2 * TEXT_VIEW_PREFETCH_SIZE);
+    end_fault_scope(scope);
+}
+
+void text_view_scroll_to_cursor(Text_View* view, s32 visible_line_count) {
+    auto buffer = view->buffer;
+    if(view->cursor < view->top) {
+        view->top = buffer_line_start(buffer, view->cursor);
+        return;
+    }
+
+    usize visible_end = view->top;
+    for(s32 i = 0; i < visible_line_count && visible_end < buffer->count; i++) {
+        visible_end = buffer_find_forward(buffer, visible_end, '\n') + 1;
+    }
+    if(view->cursor < visible_end) return;
+
+    view->top = buffer_line_start(buffer, view->cursor);
+    text_view_scroll(view, 1 - visible_line_count);
+}
+
+void text_view_jump_to_line(Text_View* view, usize line) {
+    auto buffer = view->buffer;
+    usize offset;
+    if(buffer_offset_from_line(buffer, line, &offset)) {
+        auto scope = begin_fault_scope(FAULT_JUMP);
+        buffer_prefetch(buffer, offset, TEXT_VIEW_PREFETCH_SIZE);
+        view->top = offset;
+        view->cursor = offset;
+        view->has_pending_jump = 0;
+        end_fault_scope(scope);
+        return;
+    }
+
+    auto index = buffer->line_index;
+    if(__atomic_load_n(&index->known_chunk_count, __ATOMIC_ACQUIRE) == index->chunk_count) {
+        // Everything is indexed, so the line is past the end
+        view->cursor = buffer->count;
+        view->top = buffer_line_start(buffer, buffer->count);
+        view->has_pending_jump = 0;
+    } else {
+        view->pending_jump_line = line;
+        view->has_pending_jump = 1;
+    }
+}
+
+// Moves the cursor to the line start + column code points, but not past
+// the end of that line
+usize text_view_offset_at_column(Text_Buffer* buffer, usize line_start, usize column) {
+    usize offset = line_start;
+    for(usize i = 0; i < column && offset < buffer->count; i++) {
+        if(buffer_byte(buffer, offset) == '\n') break;
+        offset = buffer_next_code_point(buffer, offset);
+    }
+    return offset;
+}
+
+usize text_view_cursor_column(Text_Buffer* buffer, usize cursor) {
+    usize line_start = buffer_line_start(buffer, cursor);
+    return buffer_count_code_points(buffer, line_start, cursor);
+}
+
+void text_view_handle_key(Text_View* view, KeySym key_symbol, u32 modifiers,
+                          String text, s32 visible_line_count) {
+    auto buffer = view->buffer;
+    int control = modifiers & ControlMask;
+    view->message = 0;
+
+    int typing = !control && text.count && (text.base[0] >= ' ' || text.base[0] == '\t') &&
+        text.base[0] != 0x7F;
+    if(!typing || !view->was_typing) buffer_begin_undo_group(buffer);
+    view->was_typing = typing;
+
+    // Shortcuts first, whatever isn't one goes through the regular keys
+    int handled = control;
+    if(control) switch(key_symbol) {
+    case XK_space: {
+        view->mark = view->cursor;
+        view->message = (cstring)"mark set";
+    } break;
+    case XK_x: {
+        usize cursor = view->cursor;
+        view->cursor = view->mark;
+        view->mark = cursor;
+    } break;
+    case XK_z:
+    case XK_Z:
+    case XK_y: {
+        int redo = key_symbol == XK_y || (modifiers & ShiftMask);
+        usize cursor;
+        int done = redo ? buffer_redo(buffer, &cursor) : buffer_undo(buffer, &cursor);
+        if(done) view->cursor = cursor;
+        else view->message = redo ? (cstring)"nothing to redo" : (cstring)"nothing to undo";
+    } break;
+    case XK_s: {
+        int started = buffer_save_async(view->save_worker, buffer);
+        view->message = started ? (cstring)"saving" : (cstring)"still saving the previous one";
+    } break;
+    default: handled = 0;
+    }
+
+    if(!handled) switch(key_symbol) {
+    case XK_Left: view->cursor = buffer_previous_code_point(buffer, view->cursor); break;
+    case XK_Right: view->cursor = buffer_next_code_point(buffer, view->cursor); break;
+    case XK_Up:
+    case XK_Down: {
+        usize column = text_view_cursor_column(buffer, view->cursor);
+        usize line_start = buffer_line_start(buffer, view->cursor);
+        if(key_symbol == XK_Up) {
+            if(line_start == 0) break;
+            line_start = buffer_line_start(buffer, line_start - 1);
+        } else {
+            usize newline = buffer_find_forward(buffer, view->cursor, '\n');
+            if(newline == buffer->count) break;
+            line_start = newline + 1;
+        }
+        view->cursor = text_view_offset_at_column(buffer, line_start, column);
+    } break;
+    case XK_Page_Up:
+    case XK_Page_Down: {
+        text_view_scroll(view, key_symbol == XK_Page_Up ? -visible_line_count : visible_line_count);
+        view->cursor = view->top;
+    } break;
+    case XK_Home: {
+        if(!control) {
+            view->cursor = buffer_line_start(buffer, view->cursor);
+            break;
+        }
+        auto scope = begin_fault_scope(FAULT_JUMP);
+        buffer_prefetch(buffer, 0, TEXT_VIEW_PREFETCH_SIZE);
+        view->cursor = 0;
+        text_view_scroll_to_cursor(view, visible_line_count);
+        end_fault_scope(scope);
+    } break;
+    case XK_End: {
+        if(!control) {
+            view->cursor = buffer_find_forward(buffer, view->cursor, '\n');
+            break;
+        }
+        // Jumping to the end doesn't need the line number, it will show up
+        // once the background indexing gets there
+        auto scope = begin_fault_scope(FAULT_JUMP);
+        usize count = std::min(buffer->count, (usize)TEXT_VIEW_PREFETCH_SIZE);
+        buffer_prefetch(buffer, buffer->count - count, count);
+        view->cursor = buffer->count;
+        text_view_scroll_to_cursor(view, visible_line_count);
+        end_fault_scope(scope);
+    } break;
+    case XK_BackSpace: {
+        usize previous = buffer_previous_code_point(buffer, view->cursor);
+        buffer_delete(buffer, previous, view->cursor - previous);
+        view->cursor = previous;
+    } break;
+    case XK_Delete: {
+        buffer_delete(buffer, view->cursor, buffer_next_code_point(buffer, view->cursor) - view->cursor);
+    } break;
+    case XK_Return:
+    case XK_KP_Enter: {
+        buffer_insert(buffer, view->cursor, S("\n"));
+        view->cursor++;
+    } break;
+    default: {
+        if(!typing) break;
+        buffer_insert(buffer, view->cursor, text);
+        view->cursor += text.count;
+    } break;
+    }
+
+    // Undo can leave the top in the middle of a line
+    view->top = buffer_line_start(buffer, view->top);
+    text_view_scroll_to_cursor(view, visible_line_count);
+}
+
+// Keeps up with a file that's being appended to. If the cursor was at the
+// very end it stays there, like tail -f.
+usize text_view_follow_file(Text_View* view, s32 visible_line_count, int* rewritten) {
+    auto buffer = view->buffer;
+    int at_end = view->cursor == buffer->count;
+    usize appended = buffer_follow_file(buffer, rewritten);
+    if(appended && at_end) {
+        view->cursor = buffer->count;
+        text_view_scroll_to_cursor(view, visible_line_count);
+    }
+    return appended;
+}
+
+s32 text_view_visible_line_count(SR_Font* font, s32 height) {
+    // The last line is taken by the status bar
+    return std::max(height / font->line_spacing - 1, 1);
+}
+
+s32 measure_text(SR_Font* font, String text) {
+    s32 x = 0;
+    for(usize i = 0; i < text.count; i++) {
+        u8 c = text.base[i];
+        if(c == '\t') {
+            x = (x / font->advance / 4 + 1) * 4 * font->advance;
+            continue;
+        }
+        if((c & 0xC0) == 0x80) continue;
+        if(c >= 128 || c < ' ') c = '?';
+        x += font->glyphs[c].advance;
+    }
+    return x;
+}
+
+// Fills the rest of the status bar after x
+void draw_progress_bar(SR_Command_List* list, SR_Font* font, s32 x,
+                       usize done, usize total) {
+    rgba8 bar_color = {220, 220, 220, 0};
+    rgba8 progress_color = {0, 160, 90, 0};
+    x += font->advance;
+    s32 bar_width = std::max(list->width - x - font->advance, 0);
+    total = std::max(total, (usize)1);
+    s32 done_width = bar_width * std::min(done, total) / total;
+    s32 bar_height = font->line_spacing / 3;
+    fill_box(list, x, bar_height, bar_width, bar_height, bar_color);
+    fill_box(list, x, bar_height, done_width, bar_height, progress_color);
+}
+
+// What a frame shows, collected while holding the editor lock so the
+// drawing itself can take its time without it. Everything is a copy on the
+// frame arena, the editor may change or free the originals meanwhile.
+struct Frame_Layout {
+    String* lines;
+    // Byte offset in the buffer each line starts at, that's how scrolling
+    // is told apart from the text changing. 0 when there's no buffer.
+    usize* line_starts;
+    s32 line_count;
+    // Line the cursor is on or -1 if it's not visible, and how many bytes
+    // of the line come before it
+    s32 cursor_line;
+    usize cursor_column;
+    String status;
+    // A progress bar after the status while progress_total isn't 0
+    usize progress_done;
+    usize progress_total;
+    int show_test_pattern;
+    // Lines of the memory overlay, none when it's hidden
+    String* overlay_lines;
+    s32 overlay_line_count;
+};
+
+Frame_Layout layout_text_view(Text_View* view, SR_Font* font, s32 width, s32 height,
+                              Arena* frame_arena) {
+    auto buffer = view->buffer;
+    if(view->has_pending_jump) {
+        text_view_jump_to_line(view, view->pending_jump_line);
+    }
+
+    Frame_Layout layout = {};
+    layout.cursor_line = -1;
+    s32 line_count = text_view_visible_line_count(font, height);
+    layout.lines = arena_push_array(frame_arena, String, line_count);
+    layout.line_starts = arena_push_array(frame_arena, usize, line_count);
+    // Enough for any line that fits on the screen, even with one pixel wide
+    // glyphs that take 4 bytes each
+    usize line_capacity = (usize)width * 4;
+
+    usize at = view->top;
+    for(s32 i = 0; i < line_count && at <= buffer->count; i++) {
+        usize line_end = buffer_find_forward(buffer, at, '\n');
+        usize line_length = std::min(line_end - at, line_capacity);
+        u8* line_bytes = arena_push(frame_arena, line_length, 1);
+        line_length = buffer_copy(buffer, at, line_bytes, line_length);
+        layout.line_starts[layout.line_count] = at;
+        layout.lines[layout.line_count++] = {line_bytes, line_length};
+
+        if(view->cursor >= at && view->cursor <= line_end) {
+            layout.cursor_line = i;
+            layout.cursor_column = std::min(view->cursor - at, line_length);
+        }
+        at = line_end + 1;
+    }
+    buffer_touch_lines(buffer, view->top, at);
+
+    usize status_capacity = 256;
+    auto status = (char*)arena_push(frame_arena, status_capacity, 1);
+    usize line;
+    auto index = buffer->line_index;
+    usize known = __atomic_load_n(&index->known_chunk_count, __ATOMIC_ACQUIRE);
+    int length;
+    if(buffer_line_from_offset(buffer, view->cursor, &line)) {
+        length = snprintf(status, status_capacity, "line %lu, column %lu", line + 1,
+                          text_view_cursor_column(buffer, view->cursor) + 1);
+    } else {
+        length = snprintf(status, status_capacity, "line ? (indexed %lu%%)",
+                          known * 100 / std::max(index->chunk_count, (usize)1));
+    }
+    if(buffer_is_modified(buffer)) {
+        length += snprintf(status + length, status_capacity - length, " *");
+    }
+    if(!text_format_is_internal(buffer->format)) {
+        length += snprintf(status + length, status_capacity - length, " [%s%s%s]",
+                           text_encoding_name(buffer->format.encoding),
+                           buffer->format.has_bom ? " BOM" : "",
+                           buffer->format.crlf ? " CRLF" : "");
+    }
+    if(mapping_is_truncated(buffer->original.base, buffer->original.count)) {
+        length += snprintf(status + length, status_capacity - length, " [truncated on disk]");
+    }
+    if(view->message) {
+        length += snprintf(status + length, status_capacity - length, " %s", view->message);
+    }
+    length = std::min(length, (int)status_capacity - 1);
+    layout.status = {(u8*)status, (usize)length};
+
+    auto worker = view->save_worker;
+    if(save_worker_busy(worker)) {
+        layout.progress_done = __atomic_load_n(&worker->bytes_written, __ATOMIC_RELAXED);
+        layout.progress_total = std::max(worker->snapshot.count, (usize)1);
+    }
+    return layout;
+}
+
+// What's there of the file while the loader is still busy, read only
+Frame_Layout layout_file_loader(File_Loader* loader, SR_Font* font, s32 height,
+                                Arena* frame_arena) {
+    Frame_Layout layout = {};
+    layout.cursor_line = -1;
+    int state = __atomic_load_n(&loader->state, __ATOMIC_ACQUIRE);
+    if(state == LOADER_PREVIEW_READY) {
+        // The preview goes away with the loader, so it gets copied too
+        s32 line_count = text_view_visible_line_count(font, height);
+        layout.lines = arena_push_array(frame_arena, String, line_count);
+        String preview = loader->preview;
+        usize at = 0;
+        while(at < preview.count && layout.line_count < line_count) {
+            auto newline = (u8*)memchr(preview.base + at, '\n', preview.count - at);
+            usize line_end = newline ? newline - preview.base : preview.count;
+            u8* line_bytes = arena_push(frame_arena, line_end - at, 1);
+            memcpy(line_bytes, preview.base + at, line_end - at);
+            layout.lines[layout.line_count++] = {line_bytes, line_end - at};
+            at = line_end + 1;
+        }
+    }
+
+    usize status_capacity = 256;
+    auto status = (char*)arena_push(frame_arena, status_capacity, 1);
+    int length = snprintf(status, status_capacity, "loading %s", loader->path);
+    length = std::min(length, (int)status_capacity - 1);
+    layout.status = {(u8*)status, (usize)length};
+    layout.progress_done = __atomic_load_n(&loader->bytes_loaded, __ATOMIC_ACQUIRE);
+    layout.progress_total = std::max(__atomic_load_n(&loader->total, __ATOMIC_ACQUIRE),
+                                     (usize)1);
+    return layout;
+}
+
+// The caret isn't drawn here, it goes on top at present time, see Caret
+void draw_frame_layout(SR_Command_List* list, SR_Font* font, Frame_Layout* layout) {
+    rgba8 text_color = {220, 220, 220, 0};
+    // Text never runs into the status bar
+    s32 status_height = layout->status.count ? font->line_spacing : 0;
+    push_clip(list, 0, status_height, list->width, list->height - status_height);
+    s32 baseline = list->height - font->ascent;
+    for(s32 i = 0; i < layout->line_count; i++) {
+        String line = layout->lines[i];
+        draw_text(list, font, 0, baseline, line, text_color);
+        baseline -= font->line_spacing;
+    }
+    pop_clip(list);
+
+    if(!layout->status.count) return;
+    rgba8 status_color = {40, 40, 40, 0};
+    fill_box(list, 0, 0, list->width, font->line_spacing, status_color);
+    s32 status_end = draw_text(list, font, 0, -font->descent, layout->status, text_color);
+    if(layout->progress_total) {
+        draw_progress_bar(list, font, status_end, layout->progress_done, layout->progress_total);
+    }
+}
+
+// Where the caret goes, empty when it's not on the screen
+SR_Rect layout_caret(Frame_Layout* layout, SR_Font* font, s32 height) {
+    if(layout->cursor_line < 0) return SR_Rect {};
+    String line = layout->lines[layout->cursor_line];
+    s32 x = measure_text(font, String {line.base, layout->cursor_column});
+    s32 baseline = height - font->ascent - layout->cursor_line * font->line_spacing;
+    return SR_Rect {x, baseline + font->descent, 2, font->ascent - font->descent};
+}
+
+// Live and peak memory per tag in the top right corner
+// The overlay's text goes in the layout, so a frame that would show the
+// same numbers isn't drawn again
+void layout_memory_overlay(Frame_Layout* layout, Arena* frame_arena) {
+    usize line_capacity = 64;
+    auto lines = (char*)arena_push(frame_arena, (MEMORY_TAG_COUNT + 1) * line_capacity, 1);
+    auto texts = arena_push_array(frame_arena, String, MEMORY_TAG_COUNT + 1);
+    s32 line_count = 0;
+    int length = snprintf(lines, line_capacity, "memory       live KB   peak KB");
+    texts[line_count++] = {(u8*)lines, (usize)length};
+    for(int i = 0; i < MEMORY_TAG_COUNT; i++) {
+        u64 peak = __atomic_load_n(&memory_stats[i].peak, __ATOMIC_RELAXED);
+        if(!peak) continue;
+        u64 live = __atomic_load_n(&memory_stats[i].live, __ATOMIC_RELAXED);
+        char* line = lines + line_count * line_capacity;
+        length = snprintf(line, line_capacity, "%-12s %7lu %9lu", memory_tag_names[i],
+                          live / 1024, peak / 1024);
+        length = std::min(length, (int)line_capacity - 1);
+        texts[line_count++] = {(u8*)line, (usize)length};
+    }
+    layout->overlay_lines = texts;
+    layout->overlay_line_count = line_count;
+}
+
+void draw_memory_overlay(SR_Command_List* list, SR_Font* font, Frame_Layout* layout) {
+    rgba8 text_color = {220, 220, 220, 0};
+    rgba8 background_color = {60, 30, 30, 0};
+    String* texts = layout->overlay_lines;
+    s32 line_count = layout->overlay_line_count;
+    s32 width = 0;
+    for(s32 i = 0; i < line_count; i++) width = std::max(width, measure_text(font, texts[i]));
+
+    s32 x = list->width - width - font->advance;
+    s32 height = line_count * font->line_spacing;
+    fill_box(list, x - font->advance, list->height - height, width + 2 * font->advance, height,
+             background_color);
+    push_clip(list, x - font->advance, list->height - height, width + 2 * font->advance, height);
+    s32 baseline = list->height - font->ascent;
+    for(s32 i = 0; i < line_count; i++) {
+        draw_text(list, font, x, baseline, texts[i], text_color);
+        baseline -= font->line_spacing;
+    }
+    pop_clip(list);
+}
+
+// Input
+//
+// The X thread only reads and decodes events, the editor runs on the render
+// thread. In between is a single producer, single consumer ring, so neither
+// side ever waits for the other. Before each frame the editor applies
+// everything that's queued up, so a burst of keys from a fast typist or
+// auto-repeat is one redraw, not one per key.
+#define INPUT_QUEUE_SIZE 256
+
+enum Input_Kind {
+    INPUT_KEY,
+    // Mouse wheel
+    INPUT_SCROLL,
+};
+
+struct Input_Event {
+    Input_Kind kind;
+    KeySym key_symbol;
+    // X modifier state mask
+    u32 modifiers;
+    // What the input method made of the key, valid UTF-8
+    u8 text[4];
+    u32 text_count;
+    s32 scroll_lines;
+    // When the X thread read it, from platform_get_time_ns
+    u64 time;
+};
+
+struct Input_Queue {
+    Input_Event events[INPUT_QUEUE_SIZE];
+    // Both only ever go up and are accessed atomically. Each is written by
+    // one side only, on its own cache line so they don't fight over it.
+    alignas(64) u64 write_index;
+    alignas(64) u64 read_index;
+};
+
+int input_queue_is_full(Input_Queue* queue) {
+    u64 read_index = __atomic_load_n(&queue->read_index, __ATOMIC_ACQUIRE);
+    return queue->write_index - read_index == INPUT_QUEUE_SIZE;
+}
+
+// X thread only. Returns 0 if the queue is full.
+int input_queue_push(Input_Queue* queue, Input_Event* event) {
+    if(input_queue_is_full(queue)) return 0;
+    queue->events[queue->write_index % INPUT_QUEUE_SIZE] = *event;
+    __atomic_store_n(&queue->write_index, queue->write_index + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Render thread only. Returns 0 if the queue is empty.
+int input_queue_pop(Input_Queue* queue, Input_Event* event) {
+    u64 write_index = __atomic_load_n(&queue->write_index, __ATOMIC_ACQUIRE);
+    if(queue->read_index == write_index) return 0;
+    *event = queue->events[queue->read_index % INPUT_QUEUE_SIZE];
+    __atomic_store_n(&queue->read_index, queue->read_index + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Editor
+//
+// The open file and everything that goes with it. Lives on the render
+// thread, the only one that touches it.
+struct Editor {
+    cstring file_path;
+    usize start_line;
+    Text_View view;
+    File_Loader* loader;
+    File_Watcher* watcher;
+    // Set while the file grows faster than one follow step takes in
+    int following;
+    File_Reloader* reloader;
+    // eventfd the loader, save and reload threads signal when they get
+    // somewhere, so the editor thread can sleep in between
+    int wake_fd;
+    // The file couldn't be read, there's no buffer then
+    int load_failed;
+    int show_memory_overlay;
+};
+
+void editor_open(Editor* editor, cstring file_path, usize start_line) {
+    editor->file_path = file_path;
+    editor->start_line = start_line;
+    editor->wake_fd = -1;
+    if(file_path) {
+        editor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        assert(editor->wake_fd >= 0, "Couldn't create an eventfd");
+        editor->loader = start_file_loader(file_path, editor->wake_fd);
+        editor->view.save_worker = make_save_worker(editor->wake_fd);
+        editor->reloader = make_file_reloader(editor->wake_fd);
+    }
+}
+
+// How often the status bar's indexing progress and jumps waiting for the
+// index get another look, the line index thread doesn't signal
+#define EDITOR_INDEX_POLL_MS 250
+
+// What the editor thread waits on between updates besides input, fills in
+// fds and returns how many. The watcher only counts while editor_update
+// reads its events, unread ones would wake us over and over.
+int editor_event_fds(Editor* editor, pollfd* fds) {
+    int count = 0;
+    fds[count++] = {editor->wake_fd, POLLIN, 0};
+    auto view = &editor->view;
+    if(editor->watcher && editor->watcher->inotify_fd >= 0 && view->buffer &&
+       !save_worker_busy(view->save_worker) && !file_reloader_busy(editor->reloader)) {
+        fds[count++] = {editor->watcher->inotify_fd, POLLIN, 0};
+    }
+    return count;
+}
+
+// How long the editor can go without editor_update, -1 for until one of
+// its events comes in
+int editor_timeout(Editor* editor) {
+    // The file grows faster than we follow, keep reading
+    if(editor->following) return 0;
+    auto buffer = editor->view.buffer;
+    if(buffer && __atomic_load_n(&buffer->line_index->background_running, __ATOMIC_ACQUIRE)) {
+        return EDITOR_INDEX_POLL_MS;
+    }
+    return -1;
+}
+
+void editor_handle_input(Editor* editor, Input_Event* event, s32 visible_line_count) {
+    auto view = &editor->view;
+    if(event->kind == INPUT_SCROLL) {
+        if(view->buffer) text_view_scroll(view, event->scroll_lines);
+        return;
+    }
+
+    if(event->key_symbol == XK_F1) {
+        editor->show_memory_overlay = !editor->show_memory_overlay;
+        return;
+    }
+    if(event->key_symbol == XK_F2) {
+        print_memory_report();
+        return;
+    }
+
+    String text = {event->text, event->text_count};
+    if(!view->buffer) {
+        if(text.count) printf("%.*s\n", (int)text.count, (char*)text.base);
+        return;
+    }
+    text_view_handle_key(view, event->key_symbol, event->modifiers, text, visible_line_count);
+}
+
+// Loading, saving and whatever happens to the file on disk. Returns 1 if
+// any of it had something to do this time.
+int editor_update(Editor* editor, s32 visible_line_count) {
+    auto view = &editor->view;
+    int busy = 0;
+    auto loader = editor->loader;
+    if(loader) {
+        busy = 1;
+        int state = __atomic_load_n(&loader->state, __ATOMIC_ACQUIRE);
+        if(state == LOADER_DONE) {
+            pthread_join(loader->thread, 0);
+            text_view_set_buffer(view, loader->buffer);
+            editor->watcher = make_file_watcher(editor->file_path);
+            // It may have grown since the loader looked at its size
+            editor->following = 1;
+            if(editor->start_line) text_view_jump_to_line(view, editor->start_line - 1);
+            // The preview isn't needed anymore
+            free_arena(&loader->arena);
+            editor->loader = 0;
+        }
+        if(state == LOADER_FAILED) {
+            // Nothing to edit, the status bar says why
+            pthread_join(loader->thread, 0);
+            free_arena(&loader->arena);
+            editor->loader = 0;
+            editor->load_failed = 1;
+        }
+    }
+
+    if(view->buffer) {
+        Save_State saved = save_worker_poll(view->save_worker, view->buffer);
+        if(saved != SAVE_IDLE) busy = 1;
+        if(saved == SAVE_DONE) {
+            view->message = (cstring)"saved";
+            // That's our file at the path now, not somebody else's
+            file_watcher_rewatch(editor->watcher);
+        }
+        if(saved == SAVE_FAILED) {
+            // The state's release store publishes source_truncated too
+            view->message = view->save_worker->source_truncated ?
+                (cstring)"couldn't save, file truncated on disk" : (cstring)"couldn't save";
+        }
+
+        Reload_State reloaded = file_reloader_poll(editor->reloader, view->buffer);
+        if(reloaded != RELOAD_IDLE) busy = 1;
+        if(reloaded == RELOAD_DONE) {
+            view->message = (cstring)"reloaded";
+            view->top = buffer_line_start(view->buffer, view->top);
+        }
+        if(reloaded == RELOAD_FAILED) view->message = (cstring)"changed on disk";
+
+        // While saving, our own rename would look like someone replaced
+        // the file, the events wait until we know the new inode. While
+        // reloading, they'd only start another reload.
+        if(file_reloader_busy(editor->reloader)) {
+            busy = 1;
+        } else if(!save_worker_busy(view->save_worker)) {
+            int changes = file_watcher_poll(editor->watcher);
+            if(changes) busy = 1;
+            if(changes & FILE_CHANGE_WRITTEN) editor->following = 1;
+            if(editor->following && !(changes & FILE_CHANGE_REPLACED)) {
+                busy = 1;
+                // Rewritten rather than appended to counts as replaced too
+                int rewritten = 0;
+                editor->following = text_view_follow_file(view, visible_line_count, &rewritten) > 0;
+                if(rewritten) changes |= FILE_CHANGE_REPLACED;
+            }
+            if(changes & FILE_CHANGE_REPLACED) {
+                if(!buffer_reload_async(editor->reloader, view->buffer)) {
+                    view->message = (cstring)"changed on disk";
+                }
+                editor->following = 0;
+            }
+        }
+    }
+    return busy;
+}
+
+// Rows
+//
+// The text area is cut into rows one line_spacing tall, from the top down.
+// Every frame remembers which line each row showed and a hash of what was
+// drawn in it, so the next frame can tell which rows it can take as they
+// are, shifted by however many rows the view scrolled, and which have to
+// be drawn again. The render thread shifts its framebuffer that way and
+// the X thread the window's contents, with XCopyArea, so scrolling by a
+// few lines only draws and uploads the few lines that came in.
+#define FRAME_MAX_ROWS 512
+#define FRAME_ROW_EMPTY ((usize)-1)
+// Rows, the status bar, and a strip between every two rows at most
+#define FRAME_MAX_DAMAGE (FRAME_MAX_ROWS / 2 + 2)
+
+struct Frame_Rows {
+    // Rows from frames that differ in any of these have nothing in common
+    s32 width, height, line_spacing, status_height;
+    s32 count;
+    // Byte offset of the row's line or FRAME_ROW_EMPTY, and a hash of it
+    usize starts[FRAME_MAX_ROWS];
+    u64 hashes[FRAME_MAX_ROWS];
+    // Of the status and the progress bar
+    u64 status_hash;
+    // Of what's on top of the rows, the test pattern and the memory overlay
+    u64 overlay_hash;
+    // Cleared for frames that have anything on top of the rows, those are
+    // never patched up row by row
+    int valid;
+    // Set when the hashes cover all of the frame, which is enough to tell
+    // whether two frames look the same, valid or not
+    int hashed;
+};
+
+void layout_frame_rows(Frame_Rows* rows, Frame_Layout* layout, SR_Font* font,
+                       s32 width, s32 height) {
+    rows->width = width;
+    rows->height = height;
+    rows->line_spacing = font->line_spacing;
+    rows->status_height = layout->status.count ? font->line_spacing : 0;
+    s32 area_height = std::max(height - rows->status_height, 0);
+    rows->count = (area_height + font->line_spacing - 1) / font->line_spacing;
+    rows->valid = !layout->show_test_pattern && !layout->overlay_line_count &&
+                  layout->status.count && rows->count <= FRAME_MAX_ROWS;
+    rows->hashed = rows->count <= FRAME_MAX_ROWS;
+    if(!rows->hashed) return;
+
+    rows->overlay_hash = hash_mix(layout->show_test_pattern, HASH_PRIME_2);
+    for(s32 i = 0; i < layout->overlay_line_count; i++) {
+        String line = layout->overlay_lines[i];
+        rows->overlay_hash = hash_mix(rows->overlay_hash ^ hash_bytes(line.base, line.count),
+                                      HASH_PRIME_1);
+    }
+
+    // Only the bar's width matters, not every byte that's done
+    s32 progress = layout->progress_total ?
+        (s32)(layout->progress_done * width / layout->progress_total) + 1 : 0;
+    rows->status_hash = hash_mix(hash_bytes(layout->status.base, layout->status.count),
+                                 HASH_PRIME_1 + progress);
+
+    for(s32 i = 0; i < rows->count; i++) {
+        if(i >= layout->line_count) {
+            rows->starts[i] = FRAME_ROW_EMPTY;
+            rows->hashes[i] = 0;
+            continue;
+        }
+        String line = layout->lines[i];
+        // No buffer means no scrolling, rows only ever match in place
+        rows->starts[i] = layout->line_starts ? layout->line_starts[i] : i;
+        rows->hashes[i] = hash_mix(hash_bytes(line.base, line.count) ^ rows->starts[i],
+                                   HASH_PRIME_1);
+    }
+}
+
+// Row i of the text area, only the part inside of it
+SR_Rect frame_row_rect(Frame_Rows* rows, s32 i) {
+    SR_Rect row = {0, rows->height - (i + 1) * rows->line_spacing,
+                   rows->width, rows->line_spacing};
+    SR_Rect area = {0, rows->status_height, rows->width, rows->height - rows->status_height};
+    return sr_intersect(row, area);
+}
+
+// What it takes to turn a frame with old rows into one with now rows.
+// Returns how many pixels up the text area has to be shifted first, then
+// everything in damage has to be drawn. Without anything in common that's
+// no shift and the whole frame.
+s32 diff_frame_rows(Frame_Rows* old, Frame_Rows* now, SR_Rect* damage, u32* damage_count) {
+    *damage_count = 0;
+    SR_Rect frame = {0, 0, now->width, now->height};
+    int compatible = old->valid && now->valid && old->width == now->width &&
+                     old->height == now->height && old->line_spacing == now->line_spacing &&
+                     old->status_height == now->status_height;
+    if(!compatible) {
+        damage[(*damage_count)++] = frame;
+        return 0;
+    }
+
+    // Scrolled down by rows when the first line is further down in the old
+    // frame, up when the old first line is further down in this one
+    s32 scroll = 0;
+    for(s32 i = 0; i < old->count; i++) {
+        if(old->starts[i] == now->starts[0]) {
+            scroll = i;
+            break;
+        }
+        if(i < now->count && now->starts[i] == old->starts[0]) {
+            scroll = -i;
+            break;
+        }
+    }
 
-void stbtt_assert_wrapper(int expression) {
-    assert(expression);
+    s32 shift = 0;
+    s32 damage_start = -1;
+    for(s32 i = 0; i <= now->count; i++) {
+        s32 from = i + scroll;
+        // Rows that were cut off by the status bar can't be taken
+        int reusable = i < now->count && from >= 0 && from < old->count &&
+                       old->hashes[from] == now->hashes[i] &&
+                       old->starts[from] == now->starts[i] &&
+                       frame_row_rect(old, from).height == old->line_spacing;
+        if(reusable) shift = scroll * now->line_spacing;
+
+        if(!reusable && i < now->count && damage_start < 0) damage_start = i;
+        if((reusable || i == now->count) && damage_start >= 0) {
+            SR_Rect top = frame_row_rect(now, damage_start);
+            SR_Rect bottom = frame_row_rect(now, i - 1);
+            damage[(*damage_count)++] = sr_union(top, bottom);
+            damage_start = -1;
+        }
+    }
+    if(old->status_hash != now->status_hash) {
+        damage[(*damage_count)++] = SR_Rect {0, 0, now->width, now->status_height};
+    }
+    return shift;
 }
 
-#define STB_TRUETYPE_IMPLEMENTATION
-#define STBTT_assert(expression) stbtt_assert_wrapper(expression)
-#include "stb_truetype.h"
+// Whether two frames look the same, the caret aside
+int frame_rows_equal(Frame_Rows* a, Frame_Rows* b) {
+    if(!a->hashed || !b->hashed || a->valid != b->valid) return 0;
+    if(a->width != b->width || a->height != b->height || a->line_spacing != b->line_spacing ||
+       a->status_height != b->status_height || a->count != b->count ||
+       a->status_hash != b->status_hash || a->overlay_hash != b->overlay_hash) {
+        return 0;
+    }
+    return !memcmp(a->starts, b->starts, a->count * sizeof(usize)) &&
+           !memcmp(a->hashes, b->hashes, a->count * sizeof(u64));
+}
 
-typedef char* cstring;
-typedef uint8_t u8;
-typedef int32_t s32;
-typedef float f32;
-typedef uint32_t u32;
-typedef uint64_t u64;
-typedef uint64_t usize;
+// Moves the text area of the framebuffer up by shift pixels, or down for
+// a negative shift. What comes in at the edge is left as it was.
+void shift_frame_rows(SR_Frame_Buffer* frame_buffer, Frame_Rows* rows, s32 shift) {
+    s32 bottom = rows->status_height;
+    s32 top = frame_buffer->height;
+    usize row_size = frame_buffer->width * sizeof(rgba8);
+    if(shift > 0) {
+        for(s32 y = top - 1; y >= bottom + shift; y--) {
+            memcpy(sr_row(frame_buffer, y), sr_row(frame_buffer, y - shift), row_size);
+        }
+    } else if(shift < 0) {
+        for(s32 y = bottom; y < top + shift; y++) {
+            memcpy(sr_row(frame_buffer, y), sr_row(frame_buffer, y - shift), row_size);
+        }
+    }
+}
 
-// Probably doesn't make sense to have all of this as global;
-Display* display;
-int root_window;
-int default_screen;
-XVisualInfo visinfo;
-Window window;
+// Rendering
+//
+// Frames are drawn on a render thread, so a slow one never holds up reading
+// input. The editor runs there too, between frames, see Input above.
+//
+// There are three framebuffers: the X thread presents the front one, the
+// render thread draws into the back one, and finished frames wait in the
+// pending one. Handing a frame over in either direction is one atomic
+// exchange of the pending index. A pending frame that gets replaced by a
+// newer one before the X thread gets to it is simply drawn over.
+#define RENDER_FRAME_COUNT 3
+#define RENDER_FRAME_FRESH 0x100
 
-struct u8_array {
-    u8* base;
-    usize count;
+struct Render_Frame {
+    SR_Frame_Buffer frame_buffer;
+    // Renderer::resize_count when it was drawn
+    u64 resize_count;
+    // What's in frame_buffer
+    Frame_Rows rows;
+    // Where the caret goes on top of it
+    SR_Rect caret;
 };
 
-typedef u8_array String;
+struct Renderer {
+    Render_Frame frames[RENDER_FRAME_COUNT];
+    // Accessed atomically. Index of the pending frame, with
+    // RENDER_FRAME_FRESH set while the X thread hasn't presented it yet.
+    u32 pending;
+    // Only touched by the render thread
+    u32 back;
+    // Only touched by the X thread
+    u32 front;
+    // Accessed atomically, set by the X thread. resize_count goes up with
+    // every size change, that's how frames drawn at the current size are
+    // told apart from older ones.
+    s32 width;
+    s32 height;
+    u64 resize_count;
+    // Accessed atomically
+    int running;
+    // Accessed atomically, set by the X thread. Nothing gets drawn while
+    // the window can't be seen, input and the editor's updates still go on.
+    int visible;
+    // eventfds, the render thread signals frame_ready_fd when a frame is
+    // pending and the X thread signals wake_fd when there's a reason to
+    // draw another one
+    int frame_ready_fd;
+    int wake_fd;
+    pthread_t thread;
 
-// Maybe it's better to use strlen instead, won't have to subtract 1 then
-#define S(static_string) String { (u8*)static_string, ARRAY_COUNT(static_string) - 1 }
+    Input_Queue* input;
+    Editor* editor;
+    SR_Font* font;
+    // Shown when there's no file
+    SR_Frame_Buffer* test_buffer;
+    Arena frame_arena;
+    // Commands of the frame being drawn and their glyphs, reset every frame
+    Arena command_arena;
+    Arena glyph_arena;
+    SR_Worker_Pool workers;
+    // What the last frame handed to the X thread showed. A frame that would
+    // look the same isn't drawn, so an idle editor doesn't draw at all.
+    Frame_Rows published_rows;
+    SR_Rect published_caret;
+};
 
-// Apparently, using anonymous strutcs inside unions like in C is considered UB
-// in C++, but it's very convenient and all compilers do the right thing,
-// so I don't give a fuck about this particular part of the C++ spec
-#pragma GCC diagnostic ignored "-Wpedantic"
-// NOTE: red and blue are inverted it seems, so an actual layout is bgra
-union rgba8 {
-    struct {
-        u8 red, green, blue, alpha;
-    };
+// Returns 0 without drawing anything when the frame would look just like
+// the last one that went out
+int render_frame(Renderer* renderer, Render_Frame* frame) {
+    auto frame_buffer = &frame->frame_buffer;
+    auto editor = renderer->editor;
+    auto font = renderer->font;
+    Arena* frame_arena = &renderer->frame_arena;
 
-    struct {
-        u8 r, g, b, a;
-    };
+    Frame_Layout layout = {};
+    layout.cursor_line = -1;
+    if(editor->view.buffer) {
+        layout = layout_text_view(&editor->view, font, frame_buffer->width,
+                                  frame_buffer->height, frame_arena);
+    } else if(editor->loader) {
+        layout = layout_file_loader(editor->loader, font, frame_buffer->height, frame_arena);
+    } else {
+        layout.show_test_pattern = 1;
+        if(editor->load_failed) {
+            usize status_capacity = 256;
+            auto status = (char*)arena_push(frame_arena, status_capacity, 1);
+            int length = snprintf(status, status_capacity, "couldn't read %s", editor->file_path);
+            layout.status = {(u8*)status, (usize)std::min(length, (int)status_capacity - 1)};
+        }
+    }
+    if(editor->show_memory_overlay) layout_memory_overlay(&layout, frame_arena);
 
-    u32 value32;
-    u8 values8[4];
-};
-#pragma GCC diagnostic pop
+    Frame_Rows* rows = arena_push_struct(frame_arena, Frame_Rows);
+    layout_frame_rows(rows, &layout, font, frame_buffer->width, frame_buffer->height);
+    SR_Rect caret = layout_caret(&layout, font, frame_buffer->height);
+    if(frame_rows_equal(rows, &renderer->published_rows) &&
+       sr_rect_equal(caret, renderer->published_caret)) {
+        return 0;
+    }
+    renderer->published_rows = *rows;
+    renderer->published_caret = caret;
+    frame->caret = caret;
 
-struct SR_Frame_Buffer {
-    s32 width, height;
-    rgba8 *base;
-};
+    auto list = make_command_list(&renderer->command_arena, &renderer->glyph_arena,
+                                  frame_buffer->width, frame_buffer->height);
+    rgba8 clear_color = {0, 128, 128, 0};
+    fill_box(&list, 0, 0, list.width, list.height, clear_color);
+    if(layout.show_test_pattern) {
+        auto test_buffer = renderer->test_buffer;
+        blit(&list, list.width - 100, list.height - 100, test_buffer,
+             0, 0, test_buffer->width, test_buffer->height);
+        blit(&list, 10, 10, &font->atlas, 0, 0, font->atlas.width, font->atlas.height);
+    }
+    draw_frame_layout(&list, font, &layout);
+    if(layout.overlay_line_count) draw_memory_overlay(&list, font, &layout);
 
-u8* platform_allocate_bytes(usize byte_count) {
-    u8* base = (u8*)malloc(byte_count);
-    assert(base, "ERROR: out of memory");
-    return base;
+    // The framebuffer still has what was drawn into it a few frames ago,
+    // only what changed since then gets drawn
+    auto damage = arena_push_array(frame_arena, SR_Rect, FRAME_MAX_DAMAGE);
+    u32 damage_count;
+    s32 shift = diff_frame_rows(&frame->rows, rows, damage, &damage_count);
+    frame->rows = *rows;
+
+    auto scope = begin_fault_scope(FAULT_DRAW);
+    shift_frame_rows(frame_buffer, rows, shift);
+    execute_command_list(frame_buffer, &list, &renderer->workers, frame_arena,
+                         damage, damage_count);
+    end_fault_scope(scope);
+    return 1;
 }
 
-SR_Frame_Buffer make_frame_buffer(s32 width, s32 height) {
-    SR_Frame_Buffer frame_buffer = {};
-    frame_buffer.width = width;
-    frame_buffer.height = height;
-    frame_buffer.base = (rgba8*)platform_allocate_bytes(width * height * sizeof(rgba8));
+void* render_thread_proc(void* data) {
+    auto renderer = (Renderer*)data;
+    u64 frame_index = 0;
+    while(__atomic_load_n(&renderer->running, __ATOMIC_ACQUIRE)) {
+        arena_reset(&renderer->frame_arena);
+        u64 frame_allocations = frame_heap_allocation_start();
+        // Arenas warm up over the first few frames. After that, anything
+        // but scrolling and drawing clears this.
+        int steady_frame = frame_index++ >= FRAME_WARM_UP_COUNT;
 
-    return frame_buffer;
-}
+        Render_Frame* frame = &renderer->frames[renderer->back];
+        frame->resize_count = __atomic_load_n(&renderer->resize_count, __ATOMIC_ACQUIRE);
+        resize_frame_buffer(&frame->frame_buffer,
+                            __atomic_load_n(&renderer->width, __ATOMIC_RELAXED),
+                            __atomic_load_n(&renderer->height, __ATOMIC_RELAXED));
 
-void fill_box(SR_Frame_Buffer* frame_buffer,
-              s32 x, s32 y, s32 width, s32 height, rgba8 color) {
-    // If x or y are negative, we decrease the size of the box we draw,
-    // as if would be partially off-screen
-    if(x < 0) {
-        width += x;
-        x = 0;
+        // Everything that came in since the last frame, all in one go
+        s32 page = text_view_visible_line_count(renderer->font, frame->frame_buffer.height);
+        Input_Event event;
+        while(input_queue_pop(renderer->input, &event)) {
+            if(event.kind != INPUT_SCROLL) steady_frame = 0;
+            editor_handle_input(renderer->editor, &event, page);
+        }
+        if(editor_update(renderer->editor, page)) steady_frame = 0;
+
+        int drawn = 0;
+        if(__atomic_load_n(&renderer->visible, __ATOMIC_ACQUIRE)) {
+            drawn = render_frame(renderer, frame);
+        }
+        if(drawn) {
+            u32 previous = __atomic_exchange_n(&renderer->pending, renderer->back |
+                                               RENDER_FRAME_FRESH, __ATOMIC_ACQ_REL);
+            renderer->back = previous & ~RENDER_FRAME_FRESH;
+        }
+        // Even without a frame, the input queue has room again
+        platform_signal_event(renderer->frame_ready_fd);
+
+        check_frame_heap_allocations(frame_allocations, steady_frame);
+        // The X thread wakes us for the next frame once it takes this one.
+        // Without one it only does for input. The editor's events wake us
+        // either way, visible or not.
+        pollfd poll_fds[3] = {{renderer->wake_fd, POLLIN, 0}};
+        int poll_count = 1 + editor_event_fds(renderer->editor, poll_fds + 1);
+        int timeout = editor_timeout(renderer->editor);
+        while(poll(poll_fds, poll_count, timeout) < 0 && errno == EINTR) {}
+        platform_consume_events(renderer->wake_fd);
+        platform_consume_events(renderer->editor->wake_fd);
     }
+    return 0;
+}
 
-    if(y < 0) {
-        height += y;
-        y = 0;
+void start_renderer(Renderer* renderer, s32 width, s32 height, usize capacity) {
+    for(int i = 0; i < RENDER_FRAME_COUNT; i++) {
+        renderer->frames[i].frame_buffer = make_frame_buffer(width, height,
+                                                             MEMORY_FRAME_BUFFER, capacity);
     }
+    renderer->back = 0;
+    renderer->pending = 1;
+    renderer->front = 2;
+    renderer->width = width;
+    renderer->height = height;
+    renderer->frame_arena = make_arena(ARENA_DEFAULT_RESERVE, MEMORY_FRAME);
+    renderer->command_arena = make_arena(ARENA_DEFAULT_RESERVE, MEMORY_FRAME);
+    renderer->glyph_arena = make_arena(ARENA_DEFAULT_RESERVE, MEMORY_FRAME);
+    start_worker_pool(&renderer->workers);
+    renderer->frame_ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    renderer->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(renderer->frame_ready_fd >= 0 && renderer->wake_fd >= 0, "Couldn't create eventfds");
+    renderer->running = 1;
+    renderer->visible = 1;
+    int err = pthread_create(&renderer->thread, 0, render_thread_proc, renderer);
+    assert(!err, "Couldn't start the render thread");
+}
 
-    if(x >= frame_buffer->width)
-        return;
+void stop_renderer(Renderer* renderer) {
+    __atomic_store_n(&renderer->running, 0, __ATOMIC_RELEASE);
+    platform_signal_event(renderer->wake_fd);
+    pthread_join(renderer->thread, 0);
+}
 
-    if(y >= frame_buffer->height)
-        return;
-    s32 end_x = std::min(x + width, frame_buffer->width);
-    s32 end_y = std::min(y + height, frame_buffer->height);
+// The X thread's side of the handoff. Returns the newest finished frame if
+// there's one it hasn't presented yet.
+Render_Frame* renderer_take_frame(Renderer* renderer) {
+    if(!(__atomic_load_n(&renderer->pending, __ATOMIC_ACQUIRE) & RENDER_FRAME_FRESH)) return 0;
+    u32 previous = __atomic_exchange_n(&renderer->pending, renderer->front, __ATOMIC_ACQ_REL);
+    renderer->front = previous & ~RENDER_FRAME_FRESH;
+    return &renderer->frames[renderer->front];
+}
 
-    // Iterating row by row
-    // I want (0,0) to be in the bottom-left corner, but XImage has (0,0) in the
-    // top left. So we're iterating from bottom to top.
-    s32 y_inverted_start = frame_buffer->height - 1 - y;
-    s32 y_inverted_end = frame_buffer->height - 1 - end_y;
-    for(s32 y_it = y_inverted_start; y_it > y_inverted_end; y_it--) {
-        for(s32 x_it = x; x_it < end_x; x_it++) {
-            frame_buffer->base[y_it * frame_buffer->width + x_it] = color;
-        }
+// Uploads the part of the frame inside rect, which is in the frame's
+// bottom-left based coordinates
+void present_rect(Render_Frame* frame, Drawable target, SR_Rect rect) {
+    auto frame_buffer = &frame->frame_buffer;
+    rect = sr_intersect(rect, SR_Rect {0, 0, frame_buffer->width, frame_buffer->height});
+    present(frame_buffer_view(frame_buffer, rect.x, rect.y, rect.width, rect.height), target,
+            rect.x, frame_buffer->height - rect.y - rect.height);
+}
+
+// The X thread's side of rows. Gets target, the window or the pixmap it's
+// presented from, from showing presented to showing frame, moving what's
+// still good with XCopyArea and uploading only the damage.
+// Returns how far it shifted what was there.
+s32 present_frame(Render_Frame* frame, Frame_Rows* presented, Drawable target) {
+    SR_Rect damage[FRAME_MAX_DAMAGE];
+    u32 damage_count;
+    Frame_Rows* rows = &frame->rows;
+    s32 shift = diff_frame_rows(presented, rows, damage, &damage_count);
+    if(shift) {
+        // X's y goes down, so up is towards 0
+        GC gc = DefaultGC(display, default_screen);
+        s32 area_height = rows->height - rows->status_height;
+        s32 distance = std::abs(shift);
+        XCopyArea(display, target, target, gc, 0, shift > 0 ? distance : 0,
+                  rows->width, area_height - distance, 0, shift > 0 ? 0 : distance);
     }
+
+    for(u32 i = 0; i < damage_count; i++) present_rect(frame, target, damage[i]);
+    *presented = *rows;
+    return shift;
 }
 
-void blit(SR_Frame_Buffer* dest, s32 dest_x, s32 dest_y,
-          SR_Frame_Buffer* src, s32 src_x, s32 src_y, s32 src_width, s32 src_height) {
-    assert(dest->base != src->base);
-    assert((0 <= src_x) && (src_x < src->width));
-    assert((0 <= src_y) && (src_y < src->height));
-    assert(src_width >= 0);
-    assert(src_x + src_width <= src->width);
-    assert(src_height >=0);
-    assert(src_y + src_height <= src->height);
+// Presenter
+//
+// Frames go out at most once per refresh. With the Present extension the
+// frame is put together in a window sized pixmap and PresentPixmap copies
+// it to the window on the next vblank, and PresentCompleteNotify tells us
+// when it's on the screen, which is when the next frame may go. Without
+// Present it's a timer at the usual refresh rate.
+#define PRESENT_FRAME_INTERVAL (1000000000ull / 60)
+// A PresentCompleteNotify that doesn't come in this long isn't coming,
+// unmapped windows for one don't get any
+#define PRESENT_TIMEOUT (100 * 1000000ull)
+// Frames in a row that timed out before we decide Present doesn't work
+// here and go on with the timer
+#define PRESENT_MAX_TIMEOUTS 20
 
-    if(dest_x < 0) {
-        src_width += dest_x;
-        src_x -= dest_x;
-        dest_x = 0;
-    }
+static_assert(sizeof(xPresentQueryVersionReq) == sz_xPresentQueryVersionReq &&
+              sizeof(xPresentSelectInputReq) == sz_xPresentSelectInputReq &&
+              sizeof(xPresentPixmapReq) == sz_xPresentPixmapReq &&
+              sizeof(xPresentCompleteNotify) == sizeof(xEvent) + 8,
+              "Present's requests and events don't match the protocol");
 
-    if(dest_y < 0) {
-        src_height += dest_y;
-        src_y -= dest_y;
-        dest_y = 0;
+struct Presenter {
+    // Major opcode of Present, 0 when the server doesn't have it or it's
+    // turned off with --no-present
+    int opcode;
+    Pixmap pixmap;
+    s32 pixmap_width, pixmap_height;
+    u32 serial;
+    // Set between PresentPixmap and its PresentCompleteNotify
+    int in_flight;
+    // Without Present, when the next frame may go. With it, when we stop
+    // waiting for PresentCompleteNotify.
+    u64 next_frame_time;
+    // Media stream counter (vblanks so far) and its time in microseconds,
+    // from the last PresentCompleteNotify
+    u64 msc;
+    u64 ust;
+    // Frames in a row that got no PresentCompleteNotify
+    u32 timeouts;
+};
+
+// X errors end the program, except those caused by our hand-made Present
+// requests. Those are only counted, and presenter_check turns Present off.
+int present_error_opcode;
+u32 present_error_count;
+XErrorHandler default_x_error_handler;
+
+int present_x_error_handler(Display* display, XErrorEvent* error) {
+    if(present_error_opcode && error->request_code == present_error_opcode) {
+        present_error_count++;
+        return 0;
     }
+    return default_x_error_handler(display, error);
+}
 
-    if(dest_x >= dest->width) {
+// Xlib drops generic events of extensions it doesn't know, this keeps
+// Present's around as cookies. Xlib frees the data itself.
+Bool present_wire_to_cookie(Display* display, XGenericEventCookie* cookie, xEvent* event) {
+    auto generic = (xGenericEvent*)event;
+    usize size = sizeof(xEvent) + generic->length * 4;
+    cookie->type = generic->type & 0x7F;
+    cookie->serial = _XSetLastRequestRead(display, (xGenericReply*)event);
+    cookie->send_event = (generic->type & 0x80) != 0;
+    cookie->display = display;
+    cookie->extension = generic->extension;
+    cookie->evtype = generic->evtype;
+    cookie->data = malloc(size);
+    if(!cookie->data) return False;
+    memcpy(cookie->data, event, size);
+    return True;
+}
+
+// present_opcode is from X_Setup, 0 to go without Present
+void start_presenter(Presenter* presenter, int present_opcode) {
+    *presenter = {};
+    presenter->opcode = present_opcode;
+    present_error_opcode = 0;
+    present_error_count = 0;
+    if(!presenter->opcode) return;
+
+    XErrorHandler handler = XSetErrorHandler(present_x_error_handler);
+    if(handler != present_x_error_handler) default_x_error_handler = handler;
+    present_error_opcode = presenter->opcode;
+    // Servers don't take any other request before this one. An error
+    // instead of the reply goes to our handler and _XReply fails.
+    LockDisplay(display);
+    auto version = (xPresentQueryVersionReq*)_XGetRequest(display, X_PresentQueryVersion,
+                                                          sz_xPresentQueryVersionReq);
+    version->reqType = presenter->opcode;
+    version->presentReqType = X_PresentQueryVersion;
+    version->majorVersion = PRESENT_MAJOR;
+    version->minorVersion = PRESENT_MINOR;
+    xPresentQueryVersionReply reply;
+    int replied = _XReply(display, (xReply*)&reply, 0, xTrue);
+    UnlockDisplay(display);
+    // PresentPixmap and PresentCompleteNotify are as old as 1.0, anything
+    // else is a server we don't understand
+    if(!replied || reply.majorVersion < 1) {
+        presenter->opcode = 0;
         return;
     }
-    if(dest_y >= dest->height) {
+
+    XESetWireToEventCookie(display, presenter->opcode, present_wire_to_cookie);
+    LockDisplay(display);
+    auto select = (xPresentSelectInputReq*)_XGetRequest(display, X_PresentSelectInput,
+                                                        sz_xPresentSelectInputReq);
+    select->reqType = presenter->opcode;
+    select->presentReqType = X_PresentSelectInput;
+    select->eid = XAllocID(display);
+    select->window = window;
+    select->eventMask = PresentCompleteNotifyMask;
+    UnlockDisplay(display);
+}
+
+// Whether the next frame may go out now
+int presenter_ready(Presenter* presenter, u64 now) {
+    if(presenter->opcode && !presenter->in_flight) return 1;
+    return now >= presenter->next_frame_time;
+}
+
+// How long poll may sleep, in milliseconds. Once we're ready a finished
+// frame wakes it up, until then it's the time left till we are.
+int presenter_timeout(Presenter* presenter, u64 now) {
+    if(presenter_ready(presenter, now)) return -1;
+    return (presenter->next_frame_time - now + 999999) / 1000000;
+}
+
+// Where present_frame should put the frame, the pixmap gets recreated when
+// the frame's size changes. Everything in it is lost then, so presented
+// rows have to be thrown away too.
+Drawable presenter_target(Presenter* presenter, Render_Frame* frame, Frame_Rows* presented) {
+    if(!presenter->opcode) return window;
+    s32 width = frame->frame_buffer.width;
+    s32 height = frame->frame_buffer.height;
+    if(presenter->pixmap && presenter->pixmap_width == width &&
+       presenter->pixmap_height == height) {
+        return presenter->pixmap;
+    }
+
+    if(presenter->pixmap) XFreePixmap(display, presenter->pixmap);
+    presenter->pixmap = XCreatePixmap(display, window, std::max(width, 1), std::max(height, 1),
+                                      visinfo.depth);
+    presenter->pixmap_width = width;
+    presenter->pixmap_height = height;
+    presented->valid = 0;
+    return presenter->pixmap;
+}
+
+// After present_frame put it in the target
+void presenter_submit(Presenter* presenter, u64 now) {
+    if(!presenter->opcode) {
+        // Stay in phase, unless we fell behind
+        presenter->next_frame_time += PRESENT_FRAME_INTERVAL;
+        if(presenter->next_frame_time < now) presenter->next_frame_time = now + PRESENT_FRAME_INTERVAL;
         return;
     }
 
-    s32 width = std::min(src_width, dest->width - dest_x);
-    s32 height = std::min(src_height, dest->height - dest_y);
+    LockDisplay(display);
+    auto request = (xPresentPixmapReq*)_XGetRequest(display, X_PresentPixmap,
+                                                    sz_xPresentPixmapReq);
+    request->reqType = presenter->opcode;
+    request->presentReqType = X_PresentPixmap;
+    request->window = window;
+    request->pixmap = presenter->pixmap;
+    request->serial = ++presenter->serial;
+    request->valid = None;
+    request->update = None;
+    request->x_off = 0;
+    request->y_off = 0;
+    request->target_crtc = None;
+    request->wait_fence = None;
+    request->idle_fence = None;
+    // Copying means the pixmap is ours again once it's complete, a flip
+    // would keep it on the screen until some other frame replaces it
+    request->options = PresentOptionCopy;
+    // The vblank after the last one we got, or the next one whenever that
+    // one has passed already
+    request->target_msc = presenter->msc ? presenter->msc + 1 : 0;
+    request->divisor = 0;
+    request->remainder = 0;
+    UnlockDisplay(display);
+    XFlush(display);
+
+    // Still in flight means the last one never completed
+    presenter->timeouts = presenter->in_flight ? presenter->timeouts + 1 : 0;
+    presenter->in_flight = 1;
+    presenter->next_frame_time = now + PRESENT_TIMEOUT;
+}
+
+// Turns Present off when the server refused one of our requests, or frames
+// keep going out without PresentCompleteNotify coming back. Whatever went
+// into the pixmap may not have made it to the window, so presented rows
+// are thrown away. Returns whether it turned it off.
+int presenter_check(Presenter* presenter, Frame_Rows* presented, u64 now) {
+    if(!presenter->opcode) return 0;
+    if(!present_error_count && presenter->timeouts < PRESENT_MAX_TIMEOUTS) return 0;
+
+    printf("Present isn't working (%u errors, %u timeouts), going on without it\n",
+           present_error_count, presenter->timeouts);
+    if(presenter->pixmap) XFreePixmap(display, presenter->pixmap);
+    presenter->opcode = 0;
+    presenter->pixmap = 0;
+    presenter->in_flight = 0;
+    presenter->next_frame_time = now;
+    presented->valid = 0;
+    return 1;
+}
 
-    for(s32 y = 0; y < height; y++) {
-        for(s32 x = 0; x < width; x++) {
-            // Should we also invert Y of the source buffer?
-            auto color = src->base[(y + src_y) * src->width + x + src_x];
-            dest->base[(dest->height - 1 - dest_y - y) * dest->width + x + dest_x] = color;
+// Handles one of Present's events, returns whether it was one
+int presenter_handle_event(Presenter* presenter, XEvent* event) {
+    XGenericEventCookie* cookie = &event->xcookie;
+    if(!presenter->opcode || event->type != GenericEvent ||
+       cookie->extension != presenter->opcode) {
+        return 0;
+    }
+    if(!XGetEventData(display, cookie)) return 1;
+    if(cookie->evtype == PresentCompleteNotify) {
+        auto complete = (xPresentCompleteNotify*)cookie->data;
+        if(complete->kind == PresentCompleteKindPixmap && complete->serial == presenter->serial) {
+            presenter->in_flight = 0;
+            presenter->msc = complete->msc;
+            presenter->ust = complete->ust;
         }
     }
+    XFreeEventData(display, cookie);
+    return 1;
 }
 
-void present(SR_Frame_Buffer frame_buffer) {
-    if((frame_buffer.width <= 0) || (frame_buffer.height <= 0)) {
-        return;
+// Caret
+//
+// The caret isn't in the framebuffers, the X thread paints it on top of
+// the frame with XFillRectangle and takes it off again by uploading the
+// few pixels under it from the frame. So blinking or moving it costs two
+// tiny rectangles, and the render thread doesn't wake up for it at all.
+#define CARET_BLINK_INTERVAL (500 * 1000000ull)
+
+struct Caret {
+    GC gc;
+    // Where the frame wants it and where it's painted, if it is, both in
+    // the frame's bottom-left based coordinates
+    SR_Rect rect;
+    SR_Rect painted;
+    int is_painted;
+    // Blink phase, it's shown right after it moves
+    int blink_on;
+    u64 next_blink_time;
+};
+
+void start_caret(Caret* caret) {
+    *caret = {};
+    caret->gc = XCreateGC(display, window, 0, 0);
+    // What fill_box would have put in the framebuffer
+    rgba8 color = {0, 200, 255, 0};
+    XSetForeground(display, caret->gc, color.value32);
+    caret->blink_on = 1;
+}
+
+// Targets are the window, and with Present also the pixmap it's presented
+// from, which would bring back whatever the window lost on the next frame
+void caret_paint(Caret* caret, Render_Frame* frame, Drawable* targets, u32 target_count) {
+    SR_Rect rect = caret->rect;
+    if(!caret->blink_on || !rect.width || !rect.height) return;
+    for(u32 i = 0; i < target_count; i++) {
+        XFillRectangle(display, targets[i], caret->gc, rect.x,
+                       frame->frame_buffer.height - rect.y - rect.height, rect.width, rect.height);
     }
+    caret->painted = rect;
+    caret->is_painted = 1;
+}
 
-    // We're manually creating XImage here instead of calling
-    // XCreateImage so we manually manage its memory instead of letting
-    // xlib to allocate it on the heap with calloc.
-    XImage image = {};
-    image.width = frame_buffer.width;
-    image.height = frame_buffer.height;
-    image.format = ZPixmap;
-    image.byte_order = ImageByteOrder(display);
-    image.bitmap_unit = BitmapUnit(display);
-    image.bitmap_bit_order = BitmapBitOrder(display);
-    image.red_mask = visinfo.visual->red_mask;
-    image.green_mask = visinfo.visual->green_mask;
-    image.blue_mask = visinfo.visual->blue_mask;
-    image.xoffset = 0;
-    image.bitmap_pad = 32;
-    image.depth = visinfo.depth;
-    image.data = (char*)frame_buffer.base;
-    image.bits_per_pixel = 32;
-    // XInitImage will initialize it instead;
-    image.bytes_per_line = 0;
+// Puts back what's under it, and where present_frame's shift moved it to
+void caret_erase(Caret* caret, Render_Frame* frame, Drawable* targets, u32 target_count,
+                 s32 shift) {
+    if(!caret->is_painted) return;
+    SR_Rect rect = caret->painted;
+    SR_Rect shifted = {rect.x, rect.y + shift, rect.width, rect.height};
+    for(u32 i = 0; i < target_count; i++) {
+        present_rect(frame, targets[i], rect);
+        if(shift) present_rect(frame, targets[i], shifted);
+    }
+    caret->is_painted = 0;
+}
 
-    GC default_gc = DefaultGC(display, default_screen);
-    assert(XInitImage(&image), "Fucked up XImage initializationi, dawg");
-    XPutImage(display, window, default_gc, &image,
-              0, 0, 0, 0, image.width, image.height);
+// A new frame went out to target, the caret goes where that one wants it
+void caret_update(Caret* caret, Render_Frame* frame, Drawable target, s32 shift, u64 now) {
+    caret_erase(caret, frame, &target, 1, shift);
+    if(!sr_rect_equal(caret->rect, frame->caret)) {
+        caret->blink_on = 1;
+        caret->next_blink_time = now + CARET_BLINK_INTERVAL;
+    }
+    caret->rect = frame->caret;
+    caret_paint(caret, frame, &target, 1);
 }
 
-void set_size_hint(Display* display, Window window,
-                   u32 min_width, u32 min_height,
-                   u32 max_width, u32 max_height) {
-    XSizeHints hints = {};
-    if(min_width > 0 && min_height > 0) hints.flags |= PMinSize;
-    if(max_width > 0 && max_height > 0) hints.flags |= PMaxSize;
+// Returns whether it changed anything
+int caret_blink(Caret* caret, Render_Frame* frame, Drawable* targets, u32 target_count, u64 now) {
+    if(!caret->rect.width || now < caret->next_blink_time) return 0;
+    caret->next_blink_time = now + CARET_BLINK_INTERVAL;
+    caret->blink_on = !caret->blink_on;
+    if(caret->blink_on) caret_paint(caret, frame, targets, target_count);
+    else caret_erase(caret, frame, targets, target_count, 0);
+    return 1;
+}
 
-    hints.min_width = min_width;
-    hints.min_height = min_height;
-    hints.max_width = max_width;
-    hints.max_height = max_height;
+// Milliseconds poll may sleep for the next blink, -1 for no blinking
+int caret_timeout(Caret* caret, u64 now) {
+    if(!caret->rect.width) return -1;
+    if(now >= caret->next_blink_time) return 0;
+    return (caret->next_blink_time - now + 999999) / 1000000;
+}
 
-    XSetWMNormalHints(display, window, &hints);
+// scame --bench-resize
+//
+// A window edge dragged back and forth, with a burst of configure events
+// arriving for every frame we draw. Compares reallocating on every event,
+// like we used to, with coalescing to one resize per frame within the
+// framebuffer's capacity.
+void bench_resize_storm() {
+    s32 frame_count = 500;
+    s32 events_per_frame = 8;
+    s32 max_width = 1920;
+    s32 max_height = 1080;
+    rgba8 clear_color = {0, 128, 128, 0};
+
+    for(int coalesce = 0; coalesce < 2; coalesce++) {
+        auto frame_buffer = make_frame_buffer(800, 600, MEMORY_FRAME_BUFFER,
+                                              coalesce ? (usize)max_width * max_height : 0);
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        long minor_faults = usage.ru_minflt;
+        u64 start = platform_get_time_ns();
+        usize reallocations = 0;
+
+        for(s32 frame = 0; frame < frame_count; frame++) {
+            s32 width = 0;
+            s32 height = 0;
+            for(s32 event = 0; event < events_per_frame; event++) {
+                // Triangle wave between 400x300 and the maximum
+                s32 step = (frame * events_per_frame + event) % 400;
+                s32 phase = step < 200 ? step : 400 - step;
+                width = 400 + (max_width - 400) * phase / 200;
+                height = 300 + (max_height - 300) * phase / 200;
+                if(!coalesce) {
+                    free_frame_buffer(&frame_buffer);
+                    frame_buffer = make_frame_buffer(width, height);
+                    reallocations++;
+                }
+            }
+            if(coalesce) {
+                usize capacity = frame_buffer.capacity;
+                resize_frame_buffer(&frame_buffer, width, height);
+                reallocations += frame_buffer.capacity != capacity;
+            }
+            fill_box(&frame_buffer, 0, 0, frame_buffer.width, frame_buffer.height, clear_color);
+        }
+
+        u64 elapsed = platform_get_time_ns() - start;
+        getrusage(RUSAGE_SELF, &usage);
+        printf("%-34s %8.2f ms/frame %6lu reallocations %9ld page faults\n",
+               coalesce ? "coalesced, capacity reserved:" : "reallocate on every event:",
+               elapsed / 1e6 / frame_count, reallocations, usage.ru_minflt - minor_faults);
+        free_frame_buffer(&frame_buffer);
+    }
 }
 
-Status toggle_maximize(Display* display, Window window) {
-    XClientMessageEvent ev = {};
-    Atom wm_state = XInternAtom(display, "_NET_WM_STATE", False);
-    Atom max_h = XInternAtom(display, "_NET_WM_STATE_MAXIMIZED_HORZ", False);
-    Atom max_v = XInternAtom(display, "_NET_WM_STATE_MAXIMIZED_VERT", False);
+// scame --check-present
+//
+// Runs the Presenter without the editor and tells whether frames go out
+// at the refresh rate. The timer is always checked. Present needs a server
+// that has it, Xvfb does, so it can be run headless as
+// xvfb-run scame --check-present; without a display it's skipped. The exit
+// status is 1 if anything failed.
+#define CHECK_PRESENT_FRAMES 60
 
-    if(wm_state == None) return 0;
+// Frames have to go out one interval apart, give or take a millisecond of
+// poll's rounding, and never early
+int check_present_timer() {
+    Presenter presenter;
+    start_presenter(&presenter, 0);
+    u64 first = 0;
+    u64 last = 0;
+    u32 early = 0;
+    for(s32 i = 0; i < CHECK_PRESENT_FRAMES; i++) {
+        u64 now = platform_get_time_ns();
+        while(!presenter_ready(&presenter, now)) {
+            poll(0, 0, presenter_timeout(&presenter, now));
+            now = platform_get_time_ns();
+        }
+        if(!first) first = now;
+        last = now;
+        presenter_submit(&presenter, now);
+        early += presenter_ready(&presenter, now);
+    }
+    double interval = (double)(last - first) / (CHECK_PRESENT_FRAMES - 1);
 
-    ev.type = ClientMessage;
-    ev.format = 32;
-    ev.window = window;
-    ev.message_type = wm_state;
-    ev.data.l[0] = 2; // _NET_WM_STATE_TOGGLE
-    ev.data.l[1] = max_h;
-    ev.data.l[2] = max_v;
-    ev.data.l[3] = 1;
+    // Falling behind starts over from now instead of catching up in a burst
+    u64 late = presenter.next_frame_time + 3 * PRESENT_FRAME_INTERVAL;
+    presenter_submit(&presenter, late);
+    int caught_up = presenter.next_frame_time == late + PRESENT_FRAME_INTERVAL &&
+                    !presenter_ready(&presenter, late);
 
-    return XSendEvent(display, DefaultRootWindow(display), False,
-                      SubstructureNotifyMask,
-                      (XEvent*)&ev);
+    int ok = !early && caught_up && interval > PRESENT_FRAME_INTERVAL - 1000000.0 &&
+             interval < PRESENT_FRAME_INTERVAL + 1000000.0;
+    printf("timer:   %d frames, %.2f ms/frame, %u early, %s after falling behind: %s\n",
+           CHECK_PRESENT_FRAMES, interval / 1e6, early, caught_up ? "in phase" : "bursts",
+           ok ? "ok" : "FAILED");
+    return ok;
 }
 
-u8_array platform_read_entire_file(cstring file_path) {
+// Every PresentPixmap has to come back as a PresentCompleteNotify, one
+// vblank after the last, with no X errors
+int check_present_pixmaps() {
+    display = XOpenDisplay(NULL);
+    if(!display) {
+        printf("present: no display, skipped\n");
+        return 1;
+    }
+    int opcode, event_base, error_base;
+    if(!XQueryExtension(display, PRESENT_NAME, &opcode, &event_base, &error_base)) {
+        printf("present: the server doesn't have it, skipped\n");
+        XCloseDisplay(display);
+        return 1;
+    }
+    root_window = DefaultRootWindow(display);
+    default_screen = DefaultScreen(display);
+    if(!XMatchVisualInfo(display, default_screen, 24, TrueColor, &visinfo)) {
+        printf("present: no 24 bit TrueColor visual, skipped\n");
+        XCloseDisplay(display);
+        return 1;
+    }
 
-    u8_array result = {};
-    int fd = open(file_path, O_RDONLY);
-    assert(fd > -1, "Couldn't open the file %s", file_path);
+    s32 width = 64;
+    s32 height = 64;
+    XSetWindowAttributes window_attr = {};
+    window_attr.colormap = XCreateColormap(display, root_window, visinfo.visual, AllocNone);
+    window_attr.event_mask = StructureNotifyMask;
+    window = XCreateWindow(display, root_window, 0, 0, width, height, 0, visinfo.depth,
+                           InputOutput, visinfo.visual, CWColormap | CWEventMask, &window_attr);
+    XMapWindow(display, window);
+    XEvent event;
+    do XWindowEvent(display, window, StructureNotifyMask, &event);
+    while(event.type != MapNotify);
 
-    struct stat statbuf;
-    int err = fstat(fd, &statbuf);
-    assert(err > -1, "Couldn't open the file %s", file_path);
+    Presenter presenter;
+    start_presenter(&presenter, opcode);
+    if(!presenter.opcode) {
+        printf("present: QueryVersion failed: FAILED\n");
+        XCloseDisplay(display);
+        return 0;
+    }
 
-    auto memory = (u8*)mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED,
-                            fd, 0);
-    assert(memory != MAP_FAILED, "Couldn't read the file's contents");
-    close(fd);
+    Render_Frame frame = {};
+    frame.frame_buffer = make_frame_buffer(width, height);
+    Frame_Rows presented = {};
+    u32 completed = 0;
+    u32 timed_out = 0;
+    u64 first_msc = 0;
+    u64 first = 0;
+    u64 last = 0;
+    // One more wait than frames, for the last one to complete
+    for(s32 i = 0; i <= CHECK_PRESENT_FRAMES; i++) {
+        u64 now = platform_get_time_ns();
+        while(!presenter_ready(&presenter, now)) {
+            if(!XPending(display)) {
+                pollfd poll_fd = {ConnectionNumber(display), POLLIN, 0};
+                poll(&poll_fd, 1, presenter_timeout(&presenter, now));
+            }
+            while(XPending(display) > 0) {
+                XNextEvent(display, &event);
+                presenter_handle_event(&presenter, &event);
+            }
+            now = platform_get_time_ns();
+        }
+        if(i) {
+            if(presenter.in_flight) timed_out++;
+            else completed++;
+        }
+        if(i == 1) {
+            first_msc = presenter.msc;
+            first = now;
+        }
+        if(i == CHECK_PRESENT_FRAMES) {
+            last = now;
+            break;
+        }
 
-    result.base = memory;
-    result.count = statbuf.st_size;
-    return result;
+        Drawable target = presenter_target(&presenter, &frame, &presented);
+        rgba8 color = {(u8)(i * 4), 128, (u8)(255 - i * 4), 0};
+        fill_box(&frame.frame_buffer, 0, 0, width, height, color);
+        present_rect(&frame, target, SR_Rect {0, 0, width, height});
+        presenter_submit(&presenter, now);
+    }
+    double interval = (double)(last - first) / (CHECK_PRESENT_FRAMES - 1);
+    u64 msc_count = presenter.msc - first_msc;
+
+    // One vblank per frame, a server without a real display may skip some
+    int ok = completed == CHECK_PRESENT_FRAMES && !timed_out && !present_error_count &&
+             msc_count >= CHECK_PRESENT_FRAMES - 1;
+    printf("present: %d frames, %u completed, %u timed out, %u errors, %lu vblanks, "
+           "%.2f ms/frame: %s\n", CHECK_PRESENT_FRAMES, completed, timed_out,
+           present_error_count, msc_count, interval / 1e6, ok ? "ok" : "FAILED");
+    free_frame_buffer(&frame.frame_buffer);
+    XCloseDisplay(display);
+    return ok;
 }
 
-int main() {
+int main(int argc, char** argv) {
     int width = 800;
     int height = 600;
 
+    // scame [--fsync=none|data|full] [--no-present] [--bench-resize] [--check-present]
+    //       [+line] [file]
+    cstring file_path = 0;
+    usize start_line = 0;
+    int use_present = 1;
+    for(int i = 1; i < argc; i++) {
+        if(argv[i][0] == '+') start_line = strtoull(argv[i] + 1, 0, 10);
+        else if(!strcmp(argv[i], "--bench-resize")) {
+            bench_resize_storm();
+            return 0;
+        }
+        else if(!strcmp(argv[i], "--check-present")) {
+            int timer_ok = check_present_timer();
+            int present_ok = check_present_pixmaps();
+            return timer_ok && present_ok ? 0 : 1;
+        }
+        else if(!strcmp(argv[i], "--no-present")) use_present = 0;
+        else if(!strcmp(argv[i], "--fsync=none")) save_fsync_policy = FSYNC_NONE;
+        else if(!strcmp(argv[i], "--fsync=data")) save_fsync_policy = FSYNC_DATA;
+        else if(!strcmp(argv[i], "--fsync=full")) save_fsync_policy = FSYNC_FULL;
+        else file_path = argv[i];
+    }
+
     display = XOpenDisplay(NULL);
 
     if(!display) {
@@ -297,7 +6324,8 @@ int main() {
     window_attr.bit_gravity = StaticGravity;
     window_attr.background_pixel = 0; // Black
     window_attr.colormap = XCreateColormap(display, root_window, visinfo.visual, AllocNone);
-    window_attr.event_mask = StructureNotifyMask | KeyPressMask | KeyReleaseMask;
+    window_attr.event_mask = StructureNotifyMask | KeyPressMask | KeyReleaseMask |
+        ButtonPressMask | ExposureMask | VisibilityChangeMask;
     u64 attribute_mask = CWBitGravity | CWBackPixel | CWColormap | CWEventMask;
 
     // Windowing
@@ -314,6 +6342,9 @@ int main() {
     XStoreName(display, window, "Scame");
     set_size_hint(display, window, 400, 300, 0, 0);
 
+    X_Setup x_setup;
+    start_x_setup(&x_setup);
+
     // Input setup
     XIM x_input_method = XOpenIM(display, 0, 0, 0);
     if(!x_input_method)
@@ -343,46 +6374,72 @@ int main() {
     if(!x_input_context)
         printf("Input Context could not be created\n");
 
+    finish_x_setup(&x_setup);
+
+    // Protocols go in before mapping, that's when window managers read them
+
+    // With _NET_WM_SYNC_REQUEST the window manager tells us before each
+    // resize step and waits for us to bump the counter, which we do once the
+    // frame at the new size is out. So it never shows a stretched or half
+    // drawn window, and doesn't resize faster than we can draw.
+    XSyncCounter sync_counter = None;
+    int sync_event_base, sync_error_base, sync_major, sync_minor;
+    if(XSyncQueryExtension(display, &sync_event_base, &sync_error_base) &&
+       XSyncInitialize(display, &sync_major, &sync_minor)) {
+        XSyncValue zero;
+        XSyncIntToValue(&zero, 0);
+        sync_counter = XSyncCreateCounter(display, zero);
+        XChangeProperty(display, window, atoms._NET_WM_SYNC_REQUEST_COUNTER, XA_CARDINAL, 32,
+                        PropModeReplace, (u8*)&sync_counter, 1);
+    }
+    Atom protocols[] = {atoms.WM_DELETE_WINDOW, atoms._NET_WM_SYNC_REQUEST};
+    if(!XSetWMProtocols(display, window, protocols, sync_counter != None ? 2 : 1))
+        printf("Couldn't register WM_PROTOCOLS property\n");
+    // Set when the window manager asked, cleared once we've answered
+    int sync_pending = 0;
+    XSyncValue sync_value = {};
+
     XMapWindow(display, window);
     XFlush(display);
 
-    // The Buffer
-    auto frame_buffer = make_frame_buffer(width, height);
     auto test_buffer = make_frame_buffer(200, 200);
     for(s32 x = 0; x < test_buffer.width; x++) {
-        test_buffer.base[0 * test_buffer.width + x] = {0, 0, 255, 0};
-        test_buffer.base[(test_buffer.height - 1) * test_buffer.width + x] = {0, 0, 255, 0};
+        *sr_pixel(&test_buffer, x, 0) = {0, 0, 255, 0};
+        *sr_pixel(&test_buffer, x, test_buffer.height - 1) = {0, 0, 255, 0};
     }
     for(s32 y = 0; y < test_buffer.height; y++) {
-        test_buffer.base[y * test_buffer.width + 0] = {0, 0, 255, 0};
-        test_buffer.base[y* test_buffer.width + test_buffer.width - 1] = {0, 0, 255, 0};
+        *sr_pixel(&test_buffer, 0, y) = {0, 0, 255, 0};
+        *sr_pixel(&test_buffer, test_buffer.width - 1, y) = {0, 0, 255, 0};
     }
 
-    Atom WM_DELETE_WINDOW = XInternAtom(display, "WM_DELETE_WINDOW", False);
-    if(!XSetWMProtocols(display, window, &WM_DELETE_WINDOW, 1))
-        printf("Couldn't register WM_DELETE_WINDOW property\n");
-
     int size_change = 0;
     int window_open = 1;
-    rgba8 clear_color = {0, 128, 128, 0};
+    // Frames are only drawn while the window is mapped and not entirely
+    // covered by other windows
+    int window_mapped = 1;
+    int window_obscured = 0;
 
     // Font stuff
-    auto font_atlas = make_frame_buffer(256, 256);
+    SR_Font font = {};
+    font.atlas = make_frame_buffer(256, 256, MEMORY_FONT);
+    auto& font_atlas = font.atlas;
     {
-        stbtt_fontinfo font;
+        stbtt_fontinfo font_info;
         auto ttf_data = platform_read_entire_file("/usr/share/fonts/TTF/Hack-Regular.ttf");
 
-        auto ok = stbtt_InitFont(&font, ttf_data.base, 0);
+        auto ok = stbtt_InitFont(&font_info, ttf_data.base, 0);
         assert(ok, "stb_truetype couldn't initialize a font");
 
         f32 pixel_height = 17 * 2.18; // 2.18 is my laptop's hidpi scale factor
-        f32 scale = stbtt_ScaleForPixelHeight(&font, pixel_height);
+        f32 scale = stbtt_ScaleForPixelHeight(&font_info, pixel_height);
         s32 ascent;
         s32 descent;
         s32 line_gap;
-        stbtt_GetFontVMetrics(&font, &ascent, &descent, &line_gap);
+        stbtt_GetFontVMetrics(&font_info, &ascent, &descent, &line_gap);
 
-        s32 line_spacing = scale * (ascent - descent + line_gap);
+        font.ascent = roundf(scale * ascent);
+        font.descent = roundf(scale * descent);
+        font.line_spacing = scale * (ascent - descent + line_gap);
 
         u8_array glyph_buffer;
         glyph_buffer.count = 64 * 64;
@@ -393,13 +6450,17 @@ int main() {
         s32 y_max_height = 0;
         for(u32 code_point = ' '; code_point < 128; code_point++) {
             s32 x0, x1, y0, y1;
-            stbtt_GetCodepointBitmapBoxSubpixel(&font, code_point, scale, scale, 0, 0,
+            stbtt_GetCodepointBitmapBoxSubpixel(&font_info, code_point, scale, scale, 0, 0,
                                                 &x0, &y0, &x1, &y1);
             s32 width = x1 - x0;
             s32 height = y1 - y0;
-            stbtt_MakeCodepointBitmapSubpixel(&font, glyph_buffer.base, width, height,
+            stbtt_MakeCodepointBitmapSubpixel(&font_info, glyph_buffer.base, width, height,
                                               width, scale, scale, 0, 0, code_point);
 
+            s32 advance;
+            s32 left_side_bearing;
+            stbtt_GetCodepointHMetrics(&font_info, code_point, &advance, &left_side_bearing);
+
 
             if(x_offset + width + 1 > font_atlas.width) {
                 x_offset = 0;
@@ -416,20 +6477,84 @@ int main() {
                     color.b = color.r;
                     color.a = color.r;
                     // stb_truetype has top to bottom Y coordinate, flip it
-                    font_atlas.base[(height - 1 - y + y_offset) * font_atlas.width + x + x_offset] = color;
+                    *sr_pixel(&font_atlas, x + x_offset, height - 1 - y + y_offset) = color;
                 }
             }
 
+            Glyph* glyph = &font.glyphs[code_point];
+            glyph->x = x_offset;
+            glyph->y = y_offset;
+            glyph->width = width;
+            glyph->height = height;
+            glyph->x_offset = x0;
+            // stb_truetype's y goes down, y1 is how far below the baseline
+            // the bitmap ends
+            glyph->y_offset = -y1;
+            glyph->advance = roundf(scale * advance);
+
             x_offset += width + 1;
             assert(x_offset <= font_atlas.width);
         }
+        font.advance = font.glyphs[' '].advance;
     }
 
-    // Event loop
+    // The text
+    Editor editor = {};
+    editor_open(&editor, file_path, start_line);
+    u64 frame_index = 0;
+
+    Input_Queue input_queue = {};
+    Renderer renderer = {};
+    renderer.input = &input_queue;
+    renderer.editor = &editor;
+    renderer.font = &font;
+    renderer.test_buffer = &test_buffer;
+    // Framebuffers with room for a maximized window right away
+    usize screen_pixel_count = (usize)DisplayWidth(display, default_screen) *
+        DisplayHeight(display, default_screen);
+    start_renderer(&renderer, width, height, screen_pixel_count);
+
+    // What's in the window, and the frame it came from
+    Frame_Rows presented_rows = {};
+    Render_Frame* presented_frame = 0;
+    Presenter presenter;
+    start_presenter(&presenter, use_present ? x_setup.present_opcode : 0);
+    Caret caret;
+    start_caret(&caret);
+
+    // Event loop. Sleeps until X has something for us or a frame is done.
+    pollfd poll_fds[2] = {
+        {ConnectionNumber(display), POLLIN, 0},
+        {renderer.frame_ready_fd, POLLIN, 0},
+    };
     while(window_open) {
+        if(input_queue_is_full(&input_queue)) {
+            // The render thread empties it before its next frame
+            platform_wait_event(renderer.frame_ready_fd);
+        } else if(!XPending(display)) {
+            // Xlib may have read events into its queue already, poll
+            // wouldn't know about those
+            u64 now = platform_get_time_ns();
+            int timeout = presenter_timeout(&presenter, now);
+            int blink_timeout = window_mapped && !window_obscured ? caret_timeout(&caret, now) : -1;
+            if(timeout < 0 || (blink_timeout >= 0 && blink_timeout < timeout)) timeout = blink_timeout;
+            poll(poll_fds, ARRAY_COUNT(poll_fds), timeout);
+        }
+        platform_consume_events(renderer.frame_ready_fd);
+
+        u64 frame_allocations = frame_heap_allocation_start();
+        // Xlib sets up its queues and caches over the first few frames.
+        // After that, anything but scrolling clears this.
+        int steady_frame = frame_index++ >= FRAME_WARM_UP_COUNT;
+
+        // Every event turns into at most one input event, what doesn't fit
+        // waits in Xlib's queue
         XEvent ev = {};
-        while(XPending(display) > 0) {
+        int input_pushed = 0;
+        while(!input_queue_is_full(&input_queue) && XPending(display) > 0) {
             XNextEvent(display, &ev);
+            if(ev.type != ButtonPress) steady_frame = 0;
+            if(presenter_handle_event(&presenter, &ev)) continue;
             switch(ev.type) {
             case DestroyNotify: {
                 auto e = (XDestroyWindowEvent*) &ev;
@@ -439,46 +6564,171 @@ int main() {
             } break;
             case ClientMessage: {
                 auto e = (XClientMessageEvent*) &ev;
-                if((Atom)e->data.l[0] == WM_DELETE_WINDOW) {
+                if((Atom)e->data.l[0] == atoms._NET_WM_SYNC_REQUEST) {
+                    // The value to set goes in l[2] (low) and l[3] (high)
+                    XSyncIntsToValue(&sync_value, e->data.l[2], e->data.l[3]);
+                    sync_pending = 1;
+                }
+                if((Atom)e->data.l[0] == atoms.WM_DELETE_WINDOW) {
                     XDestroyWindow(display, window);
                     window_open = 0;
                 }
             } break;
+            case Expose: {
+                // Covered up parts of the window are lost, they're in the
+                // framebuffer presented last, though
+                auto e = (XExposeEvent*) &ev;
+                if(!presented_frame) break;
+                s32 frame_height = presented_frame->frame_buffer.height;
+                SR_Rect rect = {e->x, frame_height - e->y - e->height, e->width, e->height};
+                present_rect(presented_frame, window, rect);
+                if(caret.is_painted && sr_intersect(rect, caret.painted).width > 0) {
+                    caret_paint(&caret, presented_frame, &window, 1);
+                }
+            } break;
+            case VisibilityNotify: {
+                auto e = (XVisibilityEvent*) &ev;
+                window_obscured = e->state == VisibilityFullyObscured;
+            } break;
+            case MapNotify: {
+                window_mapped = 1;
+            } break;
+            case UnmapNotify: {
+                window_mapped = 0;
+            } break;
+            case GraphicsExpose: {
+                auto e = (XGraphicsExposeEvent*) &ev;
+                if(e->count) break;
+                // Part of what XCopyArea moved was covered up, so the
+                // window has holes now. Next frames may have moved them
+                // around already, so everything gets uploaded again.
+                presented_rows.valid = 0;
+                if(!presented_frame) break;
+                present_frame(presented_frame, &presented_rows, window);
+                if(caret.is_painted) caret_paint(&caret, presented_frame, &window, 1);
+            } break;
             case ConfigureNotify: {
+                // Interactive resizing queues these up faster than we draw,
+                // only the last one matters
+                while(XCheckTypedWindowEvent(display, window, ConfigureNotify, &ev)) {}
                 auto e = (XConfigureEvent*) &ev;
+                if(e->width != width || e->height != height) size_change = 1;
                 width = e->width;
                 height = e->height;
-                size_change = 1;
-                if(size_change) {
-                    size_change = 0;
-                    // Maybe realloc is better;
-                    free(frame_buffer.base);
-                    frame_buffer = make_frame_buffer(width, height);
-                }
             } break;
             case KeyPress: {
                 auto e = (XKeyPressedEvent*)&ev;
                 int symbol = 0;
+                KeySym key_symbol = NoSymbol;
                 Status status = 0;
-                Xutf8LookupString(x_input_context, e, (char*)&symbol,
-                                  4, 0, &status);
+                int symbol_length = Xutf8LookupString(x_input_context, e, (char*)&symbol,
+                                                      4, &key_symbol, &status);
                 if(status == XBufferOverflow) {
                     // Should not happen since there are no utf-8 characters larger
                     // than 24bits, but something to be aware of when used to directly
                     // write to a string buffer
                     printf("Buffer overflow when trying to create keyboard symbol map\n");
-                } else if(status == XLookupChars)
-                    printf("%s\n", (char*)&symbol);
+                    break;
+                }
+
+                Input_Event input = {};
+                input.kind = INPUT_KEY;
+                input.key_symbol = key_symbol;
+                input.modifiers = e->state;
+                input.time = platform_get_time_ns();
+                if(status == XLookupChars || status == XLookupBoth) {
+                    String text = {(u8*)&symbol, (usize)symbol_length};
+                    if(utf8_validate(text)) {
+                        memcpy(input.text, text.base, text.count);
+                        input.text_count = text.count;
+                    } else {
+                        printf("Input method gave us malformed UTF-8\n");
+                    }
+                }
+                input_queue_push(&input_queue, &input);
+                input_pushed = 1;
+            } break;
+            case ButtonPress: {
+                auto e = (XButtonPressedEvent*)&ev;
+                if(e->button != Button4 && e->button != Button5) break;
+                Input_Event input = {};
+                input.kind = INPUT_SCROLL;
+                input.scroll_lines = e->button == Button4 ? -3 : 3;
+                input.modifiers = e->state;
+                input.time = platform_get_time_ns();
+                input_queue_push(&input_queue, &input);
+                input_pushed = 1;
             } break;
             }
         }
 
-        fill_box(&frame_buffer, 0, 0, frame_buffer.width, frame_buffer.height, clear_color);
+        int window_visible = window_mapped && !window_obscured;
+        // A hidden window gets nothing drawn. The render thread still
+        // handles its input, and wakes on its own for loading, saving and
+        // following the file.
+        int became_visible = window_visible && !__atomic_load_n(&renderer.visible,
+                                                                __ATOMIC_RELAXED);
+        __atomic_store_n(&renderer.visible, window_visible, __ATOMIC_RELEASE);
+        if(!window_visible && sync_pending) {
+            // No frame is coming, and there's nothing to show anyway
+            sync_pending = 0;
+            XSyncSetCounter(display, sync_counter, sync_value);
+            XFlush(display);
+        }
+
+        // The render thread draws one frame for every one we take, and when
+        // there's a new reason to
+        int wake_renderer = input_pushed || became_visible || (window_visible && size_change);
+        if(size_change) {
+            size_change = 0;
+            __atomic_store_n(&renderer.width, width, __ATOMIC_RELAXED);
+            __atomic_store_n(&renderer.height, height, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&renderer.resize_count, 1, __ATOMIC_RELEASE);
+        }
 
-        blit(&frame_buffer, frame_buffer.width - 100, frame_buffer.height - 100, &test_buffer, 0, 0, test_buffer.width, test_buffer.height);
-        blit(&frame_buffer, 10, 10, &font_atlas, 0, 0, font_atlas.width, font_atlas.height);
-        present(frame_buffer);
+        u64 now = platform_get_time_ns();
+        if(presenter_check(&presenter, &presented_rows, now) && presented_frame) {
+            // The window may never have gotten the last frame
+            s32 shift = present_frame(presented_frame, &presented_rows, window);
+            caret_update(&caret, presented_frame, window, shift, now);
+            XFlush(display);
+        }
+        Render_Frame* frame = presenter_ready(&presenter, now) ? renderer_take_frame(&renderer) : 0;
+        if(frame) {
+            Drawable target = presenter_target(&presenter, frame, &presented_rows);
+            s32 shift = present_frame(frame, &presented_rows, target);
+            caret_update(&caret, frame, target, shift, now);
+            presenter_submit(&presenter, now);
+            presented_frame = frame;
+            wake_renderer = 1;
+            // Only a frame at the size the window manager asked for counts
+            // as an answer
+            if(sync_pending &&
+               frame->resize_count == __atomic_load_n(&renderer.resize_count, __ATOMIC_RELAXED)) {
+                sync_pending = 0;
+                XSyncSetCounter(display, sync_counter, sync_value);
+                XFlush(display);
+            }
+        }
+        else if(presented_frame && window_visible) {
+            // Blinking doesn't wait for a frame, it goes right to the window
+            Drawable targets[2] = {window, presenter.pixmap};
+            if(caret_blink(&caret, presented_frame, targets, presenter.pixmap ? 2 : 1, now)) {
+                XFlush(display);
+            }
+        }
+        if(wake_renderer) platform_signal_event(renderer.wake_fd);
+        check_frame_heap_allocations(frame_allocations, steady_frame);
     }
+    stop_renderer(&renderer);
+
+    // Don't leave a half-written temporary file behind
+    if(editor.view.save_worker) save_worker_wait(editor.view.save_worker);
+
+#if defined DEBUG
+    print_fault_stats();
+    print_memory_report();
+#endif
 
     return 0;
 }